@@ -1,29 +1,173 @@
+#include <algorithm>
+#include <fstream>
 #include <iostream>
 #include <stdexcept>
 #include "buffer.hpp"
 
-depth_buffer::depth_buffer() : depth_buffer(0, 0) {}
+void clear_mask::reset(unsigned w, unsigned h)
+{
+    columns = (w + CLEAR_BLOCK - 1) / CLEAR_BLOCK;
+    untouched = columns * ((h + CLEAR_BLOCK - 1) / CLEAR_BLOCK);
+    touched.assign(untouched, 0);
+}
+
+bool clear_mask::cleared(unsigned x, unsigned y) const
+{
+    return !touched[y / CLEAR_BLOCK * columns + x / CLEAR_BLOCK];
+}
+
+bool clear_mask::cleared(unsigned x, unsigned y, unsigned w, unsigned h) const
+{
+    // an empty range holds nothing, and its last block would wrap around
+    if (w == 0 || h == 0)
+        return true;
+    for (unsigned by = y / CLEAR_BLOCK; by <= (y + h - 1) / CLEAR_BLOCK; ++by)
+        for (unsigned bx = x / CLEAR_BLOCK; bx <= (x + w - 1) / CLEAR_BLOCK; ++bx)
+            if (touched[by * columns + bx])
+                return false;
+    return true;
+}
+
+bool clear_mask::touch(unsigned x, unsigned y)
+{
+    auto &t = touched[y / CLEAR_BLOCK * columns + x / CLEAR_BLOCK];
+    if (t)
+        return false;
+    t = 1;
+    --untouched;
+    return true;
+}
+
+unsigned clear_mask::pending() const
+{
+    return untouched;
+}
+
+template <class T>
+sample_buffer<T>::sample_buffer(T clear_value) : sample_buffer(0, 0, clear_value) {}
+
+template <class T>
+sample_buffer<T>::sample_buffer(unsigned w, unsigned h, T clear_value) : width{0}, height{0}, clear_value{clear_value}
+{
+    resize(w, h);
+}
+
+// refuses images whose storage could not even be indexed
+template <class Storage>
+static void check_size(const Storage &buf, unsigned w, unsigned h, size_t channels)
+{
+    if (h && w > buf.max_size() / channels / h)
+    {
+        throw std::length_error("image too large");
+    }
+}
+
+template <class T>
+void sample_buffer<T>::resize(unsigned w, unsigned h)
+{
+    check_size(buf, w, h, 1);
+    if (w != width || h != height)
+    {
+        // storage is allocated again on first use
+        width = w;
+        height = h;
+        buffer_storage<T>().swap(buf);
+    }
+    clear();
+}
+
+template <class T>
+void sample_buffer<T>::clear()
+{
+    mask.reset(width, height);
+}
 
-depth_buffer::depth_buffer(unsigned w, unsigned h) : width{w}, height{h}, buf(w * h, 1.0) {}
+template <class T>
+bool sample_buffer<T>::cleared(unsigned x, unsigned y) const
+{
+    return mask.cleared(x, y);
+}
 
-double &depth_buffer::operator()(unsigned x, unsigned y)
+template <class T>
+void sample_buffer<T>::fill(unsigned x, unsigned y)
+{
+    buf.resize(static_cast<size_t>(width) * height);
+    x -= x % CLEAR_BLOCK;
+    y -= y % CLEAR_BLOCK;
+    auto w = std::min(width - x, CLEAR_BLOCK + 0u), h = std::min(height - y, CLEAR_BLOCK + 0u);
+    for (unsigned i = 0; i < h; ++i)
+        std::fill_n(&buf[static_cast<size_t>(y + i) * width + x], w, clear_value);
+}
+
+template <class T>
+T &sample_buffer<T>::operator()(unsigned x, unsigned y)
 {
     if (x >= width || y >= height)
     {
         throw std::out_of_range("pixel index out of range");
     }
-    return buf[y * width + x];
+    if (mask.touch(x, y))
+        fill(x, y);
+    return buf[static_cast<size_t>(y) * width + x];
 }
 
+template class sample_buffer<double>;
+template class sample_buffer<unsigned>;
+
 template <class T>
 frame_buffer<T>::frame_buffer() : frame_buffer(0, 0) {}
 
 template <class T>
-frame_buffer<T>::frame_buffer(unsigned w, unsigned h) : width{w}, height{h}, buf(w * h * 4, 0) {}
+frame_buffer<T>::frame_buffer(unsigned w, unsigned h) : width{0}, height{0}
+{
+    resize(w, h);
+}
+
+template <class T>
+void frame_buffer<T>::resize(unsigned w, unsigned h)
+{
+    check_size(buf, w, h, 4);
+    if (w != width || h != height)
+    {
+        // storage is allocated again on first use
+        width = w;
+        height = h;
+        buffer_storage<T>().swap(buf);
+    }
+    clear();
+}
+
+template <class T>
+void frame_buffer<T>::clear()
+{
+    mask.reset(width, height);
+}
+
+template <class T>
+bool frame_buffer<T>::cleared(unsigned x, unsigned y, unsigned w, unsigned h) const
+{
+    return mask.cleared(x, y, w, h);
+}
 
 template <class T>
-std::vector<T> &frame_buffer<T>::data()
+void frame_buffer<T>::fill(unsigned x, unsigned y)
 {
+    buf.resize(static_cast<size_t>(width) * height * 4);
+    x -= x % CLEAR_BLOCK;
+    y -= y % CLEAR_BLOCK;
+    auto w = std::min(width - x, CLEAR_BLOCK + 0u), h = std::min(height - y, CLEAR_BLOCK + 0u);
+    for (unsigned i = 0; i < h; ++i)
+        std::fill_n(&buf[(static_cast<size_t>(y + i) * width + x) * 4], w * 4, T(0));
+}
+
+template <class T>
+buffer_storage<T> &frame_buffer<T>::data()
+{
+    // hand out the whole image, so every block has to be filled by now
+    for (unsigned y = 0; mask.pending() && y < height; y += CLEAR_BLOCK)
+        for (unsigned x = 0; x < width; x += CLEAR_BLOCK)
+            if (mask.touch(x, y))
+                fill(x, y);
     return buf;
 }
 
@@ -34,16 +178,70 @@ T &frame_buffer<T>::operator()(unsigned x, unsigned y, unsigned channel)
     {
         throw std::out_of_range("pixel index out of range");
     }
-    return buf[(y * width + x) * 4 + channel];
+    if (mask.touch(x, y))
+        fill(x, y);
+    return buf[(static_cast<size_t>(y) * width + x) * 4 + channel];
+}
+
+template <class T>
+const T &frame_buffer<T>::operator()(unsigned x, unsigned y, unsigned channel) const
+{
+    static const T clear_value = T(0);
+    if (x >= width || y >= height)
+    {
+        throw std::out_of_range("pixel index out of range");
+    }
+    if (mask.cleared(x, y))
+        return clear_value;
+    return buf[(static_cast<size_t>(y) * width + x) * 4 + channel];
 }
 
 template <class T>
 void frame_buffer<T>::set_color(unsigned x, unsigned y, T r, T g, T b, T a)
 {
-    buf[(y * width + x) * 4 + 0] = b;
-    buf[(y * width + x) * 4 + 1] = g;
-    buf[(y * width + x) * 4 + 2] = r;
-    buf[(y * width + x) * 4 + 3] = a;
+    if (mask.touch(x, y))
+        fill(x, y);
+    buf[(static_cast<size_t>(y) * width + x) * 4 + 0] = b;
+    buf[(static_cast<size_t>(y) * width + x) * 4 + 1] = g;
+    buf[(static_cast<size_t>(y) * width + x) * 4 + 2] = r;
+    buf[(static_cast<size_t>(y) * width + x) * 4 + 3] = a;
 }
+
+template <class T>
+void frame_buffer<T>::read_row(unsigned y, unsigned char *rgba) const
+{
+    // set_color stores BGRA, but resolve() hands it the colour channels
+    // swapped, so the image it leaves is RGBA, as the web build shows it
+    for (unsigned x = 0; x < width; ++x, rgba += 4)
+    {
+        if (mask.cleared(x, y))
+        {
+            std::fill_n(rgba, 4, 0);
+            continue;
+        }
+        auto p = &buf[(static_cast<size_t>(y) * width + x) * 4];
+        for (int i = 0; i < 4; ++i)
+            rgba[i] = std::min(std::max(p[i], T(0)), T(255));
+    }
+}
+
+template <class T>
+void frame_buffer<T>::save(std::string &filename, int level, unsigned threads)
+{
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("cannot write " + filename);
+    }
+    // rows are read straight out of buf
+    write_png(file, width, height, [this](unsigned y, unsigned char *rgba)
+              { read_row(y, rgba); },
+              level, threads);
+    if (!file)
+    {
+        throw std::runtime_error("cannot write " + filename);
+    }
+}
+
 template class frame_buffer<double>;
 template class frame_buffer<unsigned char>;
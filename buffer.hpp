@@ -1,18 +1,75 @@
 #pragma once
+#include <memory>
+#include <string>
+#include <utility>
 #include <vector>
+#include "png.hpp"
 
-class depth_buffer
+// side of the square blocks of pixels that are cleared lazily
+#define CLEAR_BLOCK 16
+
+// leaves elements uninitialized, so that storage is only written once a
+// block is actually touched
+template <class T>
+struct uninitialized_allocator : std::allocator<T>
+{
+    template <class U>
+    struct rebind
+    {
+        using other = uninitialized_allocator<U>;
+    };
+    uninitialized_allocator() = default;
+    template <class U>
+    uninitialized_allocator(const uninitialized_allocator<U> &) {}
+    template <class U>
+    void construct(U *p) { ::new (static_cast<void *>(p)) U; }
+    template <class U, class... Args>
+    void construct(U *p, Args &&...args) { ::new (static_cast<void *>(p)) U(std::forward<Args>(args)...); }
+};
+
+template <class T>
+using buffer_storage = std::vector<T, uninitialized_allocator<T>>;
+
+// remembers which blocks of an image still hold nothing but the clear value
+class clear_mask
+{
+public:
+    void reset(unsigned w, unsigned h);
+    bool cleared(unsigned x, unsigned y) const;
+    bool cleared(unsigned x, unsigned y, unsigned w, unsigned h) const;
+    // marks the block of (x, y) as written, true if it was still cleared
+    bool touch(unsigned x, unsigned y);
+    unsigned pending() const;
+
+private:
+    unsigned columns = 0, untouched = 0;
+    std::vector<unsigned char> touched;
+};
+
+// one value per sample, cleared lazily like frame_buffer below; depth
+// buffers are cleared to 1.0, visibility buffers to 0 (no primitive)
+template <class T>
+class sample_buffer
 {
 public:
     unsigned width, height;
-    depth_buffer();
-    depth_buffer(unsigned w, unsigned h);
-    double &operator()(unsigned x, unsigned y);
+    explicit sample_buffer(T clear_value);
+    sample_buffer(unsigned w, unsigned h, T clear_value);
+    void resize(unsigned w, unsigned h);
+    void clear();
+    bool cleared(unsigned x, unsigned y) const;
+    T &operator()(unsigned x, unsigned y);
 
 private:
-    std::vector<double> buf;
+    T clear_value;
+    buffer_storage<T> buf;
+    clear_mask mask;
+    void fill(unsigned x, unsigned y);
 };
 
+// colour buffers are cleared to transparent black;
+// clearing and resizing to the same size only reset the block mask, and
+// a block is filled with the clear value when it is first accessed
 template <class T>
 class frame_buffer
 {
@@ -20,11 +77,18 @@ public:
     unsigned width, height;
     frame_buffer();
     frame_buffer(unsigned w, unsigned h);
-    std::vector<T> &data();
+    void resize(unsigned w, unsigned h);
+    void clear();
+    bool cleared(unsigned x, unsigned y, unsigned w = 1, unsigned h = 1) const;
+    buffer_storage<T> &data();
     T &operator()(unsigned x, unsigned y, unsigned channel);
+    const T &operator()(unsigned x, unsigned y, unsigned channel) const;
     void set_color(unsigned x, unsigned y, T r, T g, T b, T a);
-    void save(std::string &filename);
+    void read_row(unsigned y, unsigned char *rgba) const;
+    void save(std::string &filename, int level = PNG_LEVEL_DEFAULT, unsigned threads = 0);
 
 private:
-    std::vector<T> buf;
+    buffer_storage<T> buf;
+    clear_mask mask;
+    void fill(unsigned x, unsigned y);
 };
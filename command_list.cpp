@@ -0,0 +1,422 @@
+#include <algorithm>
+#include <stdexcept>
+#include "command_list.hpp"
+
+command_list::command_list(texture_cache &textures)
+    : textures(textures),
+      color{255.0, 255.0, 255.0, 1.0}, texcoord{0.0, 0.0},
+      emitted_color{255.0, 255.0, 255.0, 1.0}, emitted_texcoord{0.0, 0.0},
+      textured{false}, emitted_textured{false},
+      image{-1}, emitted_image{-1},
+      depth{false}, srgb{false}, perspective{false}, frustum{false},
+      cull{false}, decals{false}, deferred{false}
+{
+}
+
+void command_list::emit(list_op op, double a0, double a1, double a2, double a3)
+{
+    commands.push_back({op, {a0, a1, a2, a3}, {0, 0, 0}});
+}
+
+void command_list::emit_draw(list_op op, int i1, int i2, int i3, double size)
+{
+    commands.push_back({op, {size, 0, 0, 0}, {i1, i2, i3}});
+}
+
+int command_list::vertex_index(int i)
+{
+    if (i == 0)
+        throw std::out_of_range("index cannot be 0");
+    if (i < 0)
+        return alphas.size() + i;
+    return i - 1;
+}
+
+// opaque depth-tested triangles cover what they win the depth test against
+// whatever the order, so only ties at equal depth can come out differently
+bool command_list::movable(const std::array<int, 3> &v)
+{
+    if (!depth)
+        return false;
+    bool opaque = true;
+    for (auto k : v)
+        opaque = opaque && k >= 0 && k < static_cast<int>(alphas.size()) && alphas[k] == 1.0;
+    if (textured)
+        return (image >= 0 && image_opaque[image]) || (decals && opaque);
+    return opaque;
+}
+
+void command_list::sync_attributes()
+{
+    if (!std::equal(color, color + 4, emitted_color))
+    {
+        emit(COLOR_OP, color[0], color[1], color[2], color[3]);
+        std::copy(color, color + 4, emitted_color);
+    }
+    if (!std::equal(texcoord, texcoord + 2, emitted_texcoord))
+    {
+        emit(TEXCOORD_OP, texcoord[0], texcoord[1]);
+        std::copy(texcoord, texcoord + 2, emitted_texcoord);
+    }
+}
+
+void command_list::sync_texture(bool want_textured, int want_image)
+{
+    if (want_textured && want_image != emitted_image)
+    {
+        commands.push_back({BIND_TEXTURE_OP, {0, 0, 0, 0}, {want_image, 0, 0}});
+        emitted_image = want_image;
+    }
+    if (want_textured != emitted_textured)
+    {
+        emit(want_textured ? ENABLE_TEXTURE_OP : DISABLE_TEXTURE_OP);
+        emitted_textured = want_textured;
+    }
+}
+
+void command_list::flush_groups()
+{
+    for (auto &g : groups)
+    {
+        sync_texture(g.textured, g.image);
+        for (auto &v : g.triangles)
+            emit_draw(TRIANGLE_OP, v[0], v[1], v[2]);
+    }
+    groups.clear();
+}
+
+// brings the state a replay leaves behind up to date with the recording
+void command_list::finish()
+{
+    flush_groups();
+    sync_attributes();
+    if (image != emitted_image)
+    {
+        commands.push_back({BIND_TEXTURE_OP, {0, 0, 0, 0}, {image, 0, 0}});
+        emitted_image = image;
+    }
+    sync_texture(textured, image);
+}
+
+void command_list::resize(int w, int h)
+{
+    flush_groups();
+    emit(RESIZE_OP, w, h);
+}
+
+void command_list::add_vec(double x, double y, double z, double w)
+{
+    // colours and texture coordinates only matter once a vertex takes them
+    sync_attributes();
+    emit(VERTEX_OP, x, y, z, w);
+    alphas.push_back(color[3]);
+}
+
+void command_list::set_color(double r, double g, double b, double a)
+{
+    color[0] = r;
+    color[1] = g;
+    color[2] = b;
+    color[3] = a;
+}
+
+void command_list::set_texcoord(double s, double t)
+{
+    texcoord[0] = s;
+    texcoord[1] = t;
+}
+
+void command_list::draw_point(int i, double size)
+{
+    auto k = vertex_index(i);
+    flush_groups();
+    sync_texture(textured, image);
+    emit_draw(POINT_OP, k, 0, 0, size);
+}
+
+void command_list::draw_triangle(int i1, int i2, int i3)
+{
+    std::array<int, 3> v = {{vertex_index(i1), vertex_index(i2), vertex_index(i3)}};
+    if (!movable(v))
+    {
+        flush_groups();
+        sync_texture(textured, image);
+        emit_draw(TRIANGLE_OP, v[0], v[1], v[2]);
+        return;
+    }
+
+    auto key = textured ? image : -1;
+    for (auto &g : groups)
+    {
+        if (g.textured == textured && g.image == key)
+        {
+            g.triangles.push_back(v);
+            return;
+        }
+    }
+    groups.push_back({textured, key, {v}});
+}
+
+void command_list::draw_triangles(const std::vector<int> &indices)
+{
+    expand_triangles(TRIANGLE_LIST, indices, [this](int i1, int i2, int i3)
+                     { draw_triangle(i1, i2, i3); });
+}
+
+void command_list::draw_triangle_strip(const std::vector<int> &indices)
+{
+    expand_triangles(TRIANGLE_STRIP, indices, [this](int i1, int i2, int i3)
+                     { draw_triangle(i1, i2, i3); });
+}
+
+void command_list::draw_triangle_fan(const std::vector<int> &indices)
+{
+    expand_triangles(TRIANGLE_FAN, indices, [this](int i1, int i2, int i3)
+                     { draw_triangle(i1, i2, i3); });
+}
+
+void command_list::draw_line(int i1, int i2)
+{
+    auto k1 = vertex_index(i1), k2 = vertex_index(i2);
+    flush_groups();
+    sync_texture(textured, image);
+    emit_draw(LINE_OP, k1, k2);
+}
+
+void command_list::draw_wuline(int i1, int i2)
+{
+    auto k1 = vertex_index(i1), k2 = vertex_index(i2);
+    flush_groups();
+    sync_texture(textured, image);
+    emit_draw(WULINE_OP, k1, k2);
+}
+
+// settings that cannot be turned off again end the groups before them
+void command_list::enable_depth()
+{
+    if (depth)
+        return;
+    flush_groups();
+    depth = true;
+    emit(DEPTH_OP);
+}
+
+void command_list::enable_srgb()
+{
+    if (srgb)
+        return;
+    flush_groups();
+    srgb = true;
+    emit(SRGB_OP);
+}
+
+void command_list::enable_perspective()
+{
+    if (perspective)
+        return;
+    flush_groups();
+    perspective = true;
+    emit(PERSPECTIVE_OP);
+}
+
+void command_list::enable_frustum_clipping()
+{
+    if (frustum)
+        return;
+    flush_groups();
+    frustum = true;
+    emit(FRUSTUM_OP);
+}
+
+void command_list::enable_fsaa(int level)
+{
+    flush_groups();
+    emit(FSAA_OP, level);
+}
+
+void command_list::cull_face()
+{
+    if (cull)
+        return;
+    flush_groups();
+    cull = true;
+    emit(CULL_OP);
+}
+
+void command_list::load_texture(const std::string &filename)
+{
+    // decoded now, so that replays skip reading and hashing the file
+    auto texture = textures.load(filename);
+    for (image = 0; image < static_cast<int>(images.size()); ++image)
+        if (images[image] == texture)
+            return;
+    images.push_back(texture);
+    image_opaque.push_back(is_opaque(*texture));
+}
+
+void command_list::enable_texture()
+{
+    textured = true;
+}
+
+void command_list::disable_texture()
+{
+    textured = false;
+}
+
+void command_list::enable_decals()
+{
+    if (decals)
+        return;
+    flush_groups();
+    decals = true;
+    emit(DECALS_OP);
+}
+
+void command_list::enable_deferred()
+{
+    if (deferred)
+        return;
+    flush_groups();
+    deferred = true;
+    emit(DEFERRED_OP);
+}
+
+void command_list::clip(double p1, double p2, double p3, double p4)
+{
+    flush_groups();
+    emit(CLIP_OP, p1, p2, p3, p4);
+}
+
+void command_list::enable_tiling(int size)
+{
+    flush_groups();
+    emit(TILING_OP, size);
+}
+
+// the vertex stage transforms at draw time, so no group may be drawn
+// under a different matrix than it was recorded with
+void command_list::emit_matrix(list_op op, const matrix4 &m)
+{
+    flush_groups();
+    commands.push_back({op, {0, 0, 0, 0}, {static_cast<int>(matrices.size()), 0, 0}});
+    matrices.push_back(m);
+}
+
+void command_list::load_matrix(const matrix4 &m)
+{
+    emit_matrix(LOAD_MATRIX_OP, m);
+}
+
+void command_list::multiply_matrix(const matrix4 &m)
+{
+    emit_matrix(MULTIPLY_MATRIX_OP, m);
+}
+
+void command_list::push_matrix()
+{
+    emit(PUSH_MATRIX_OP);
+}
+
+void command_list::pop_matrix()
+{
+    flush_groups();
+    emit(POP_MATRIX_OP);
+}
+
+size_t command_list::size() const
+{
+    size_t pending = 0;
+    for (auto &g : groups)
+        pending += g.triangles.size();
+    return commands.size() + pending;
+}
+
+void command_list::replay(rasterizer &raster)
+{
+    finish();
+    // list indices become relative to the vertices replayed so far
+    int added = 0;
+    for (auto &c : commands)
+    {
+        switch (c.op)
+        {
+        case VERTEX_OP:
+            raster.add_vec(c.arg[0], c.arg[1], c.arg[2], c.arg[3]);
+            ++added;
+            break;
+        case COLOR_OP:
+            raster.set_color(c.arg[0], c.arg[1], c.arg[2], c.arg[3]);
+            break;
+        case TEXCOORD_OP:
+            raster.set_texcoord(c.arg[0], c.arg[1]);
+            break;
+        case TRIANGLE_OP:
+            raster.draw_triangle(c.index[0] - added, c.index[1] - added, c.index[2] - added);
+            break;
+        case POINT_OP:
+            raster.draw_point(c.index[0] - added, c.arg[0]);
+            break;
+        case LINE_OP:
+            raster.draw_line(c.index[0] - added, c.index[1] - added);
+            break;
+        case WULINE_OP:
+            raster.draw_wuline(c.index[0] - added, c.index[1] - added);
+            break;
+        case RESIZE_OP:
+            raster.resize(c.arg[0], c.arg[1]);
+            break;
+        case DEPTH_OP:
+            raster.enable_depth();
+            break;
+        case SRGB_OP:
+            raster.enable_srgb();
+            break;
+        case PERSPECTIVE_OP:
+            raster.enable_perspective();
+            break;
+        case FRUSTUM_OP:
+            raster.enable_frustum_clipping();
+            break;
+        case FSAA_OP:
+            raster.enable_fsaa(c.arg[0]);
+            break;
+        case CULL_OP:
+            raster.cull_face();
+            break;
+        case BIND_TEXTURE_OP:
+            raster.bind_texture(c.index[0] < 0 ? nullptr : images[c.index[0]]);
+            break;
+        case ENABLE_TEXTURE_OP:
+            raster.enable_texture();
+            break;
+        case DISABLE_TEXTURE_OP:
+            raster.disable_texture();
+            break;
+        case DECALS_OP:
+            raster.enable_decals();
+            break;
+        case DEFERRED_OP:
+            raster.enable_deferred();
+            break;
+        case CLIP_OP:
+            raster.clip(c.arg[0], c.arg[1], c.arg[2], c.arg[3]);
+            break;
+        case TILING_OP:
+            raster.enable_tiling(c.arg[0]);
+            break;
+        case LOAD_MATRIX_OP:
+            raster.load_matrix(matrices[c.index[0]]);
+            break;
+        case MULTIPLY_MATRIX_OP:
+            raster.multiply_matrix(matrices[c.index[0]]);
+            break;
+        case PUSH_MATRIX_OP:
+            raster.push_matrix();
+            break;
+        case POP_MATRIX_OP:
+            raster.pop_matrix();
+            break;
+        }
+    }
+}
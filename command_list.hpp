@@ -0,0 +1,116 @@
+#pragma once
+#include <array>
+#include <string>
+#include <vector>
+#include "rasterize.hpp"
+
+enum list_op
+{
+    VERTEX_OP,
+    COLOR_OP,
+    TEXCOORD_OP,
+    TRIANGLE_OP,
+    POINT_OP,
+    LINE_OP,
+    WULINE_OP,
+    RESIZE_OP,
+    DEPTH_OP,
+    SRGB_OP,
+    PERSPECTIVE_OP,
+    FRUSTUM_OP,
+    FSAA_OP,
+    CULL_OP,
+    BIND_TEXTURE_OP,
+    ENABLE_TEXTURE_OP,
+    DISABLE_TEXTURE_OP,
+    DECALS_OP,
+    DEFERRED_OP,
+    CLIP_OP,
+    TILING_OP,
+    LOAD_MATRIX_OP,
+    MULTIPLY_MATRIX_OP,
+    PUSH_MATRIX_OP,
+    POP_MATRIX_OP
+};
+
+struct list_command
+{
+    list_op op;
+    double arg[4];
+    int index[3]; // vertices counted from the first one in the list, or
+                  // the image or matrix to use
+};
+
+// draws and state changes recorded once and replayed onto any number of
+// new rasterizers; state changes are only kept where a draw needs them,
+// and opaque depth-tested triangles, which may be drawn in any order, are
+// grouped by texture state until the next draw or setting that may not
+class command_list
+{
+public:
+    explicit command_list(texture_cache &textures = texture_cache::shared());
+    // the same calls as on rasterizer; indices are resolved against the
+    // vertices of the list itself, so positive ones count from its start
+    void resize(int w, int h);
+    void add_vec(double x, double y, double z, double w);
+    void set_color(double r, double g, double b, double a);
+    void set_texcoord(double s, double t);
+    void draw_point(int i, double size);
+    void draw_triangle(int i1, int i2, int i3);
+    void draw_triangles(const std::vector<int> &indices);
+    void draw_triangle_strip(const std::vector<int> &indices);
+    void draw_triangle_fan(const std::vector<int> &indices);
+    void draw_line(int i1, int i2);
+    void draw_wuline(int i1, int i2);
+    void enable_depth();
+    void enable_srgb();
+    void enable_perspective();
+    void enable_frustum_clipping();
+    void enable_fsaa(int level);
+    void cull_face();
+    void load_texture(const std::string &filename);
+    void enable_texture();
+    void disable_texture();
+    void enable_decals();
+    void enable_deferred();
+    void clip(double p1, double p2, double p3, double p4);
+    void enable_tiling(int size = TILE_SIZE);
+    void load_matrix(const matrix4 &m);
+    void multiply_matrix(const matrix4 &m);
+    void push_matrix();
+    void pop_matrix();
+    void replay(rasterizer &raster);
+    // commands recorded so far, with grouped draws that are still pending;
+    // the state changes replay appends to catch up are not counted
+    size_t size() const;
+
+private:
+    // draws sharing a texture state, waiting to be emitted together
+    struct group
+    {
+        bool textured;
+        int image;
+        std::vector<std::array<int, 3>> triangles;
+    };
+    texture_cache &textures;
+    std::vector<list_command> commands;
+    std::vector<texture_ptr> images;
+    std::vector<matrix4> matrices;
+    std::vector<unsigned char> image_opaque;
+    std::vector<double> alphas; // per vertex
+    std::vector<group> groups;
+    double color[4], texcoord[2];
+    double emitted_color[4], emitted_texcoord[2];
+    bool textured, emitted_textured;
+    int image, emitted_image; // into images, -1 for none
+    bool depth, srgb, perspective, frustum, cull, decals, deferred;
+    int vertex_index(int i);
+    bool movable(const std::array<int, 3> &v);
+    void emit(list_op op, double a0 = 0, double a1 = 0, double a2 = 0, double a3 = 0);
+    void emit_draw(list_op op, int i1, int i2 = 0, int i3 = 0, double size = 0);
+    void sync_attributes();
+    void sync_texture(bool textured, int image);
+    void flush_groups();
+    void emit_matrix(list_op op, const matrix4 &m);
+    void finish();
+};
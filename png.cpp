@@ -0,0 +1,922 @@
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "png.hpp"
+#include "threads.hpp"
+
+static const unsigned len_base[] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                    35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+static const unsigned len_extra[] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                     3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+static const unsigned dist_base[] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                     257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                     8193, 12289, 16385, 24577};
+static const unsigned dist_extra[] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                      7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+
+// fixed Huffman codes of RFC 1951, bit-reversed for an LSB-first stream
+struct fixed_codes
+{
+    unsigned lit[288], lit_bits[288];
+    unsigned dist[30];
+    unsigned char len_sym[259];
+    fixed_codes()
+    {
+        for (unsigned i = 0; i < 288; ++i)
+        {
+            unsigned code, bits;
+            if (i < 144)
+                code = 0x30 + i, bits = 8;
+            else if (i < 256)
+                code = 0x190 + i - 144, bits = 9;
+            else if (i < 280)
+                code = i - 256, bits = 7;
+            else
+                code = 0xc0 + i - 280, bits = 8;
+            lit[i] = reverse(code, bits);
+            lit_bits[i] = bits;
+        }
+        for (unsigned i = 0; i < 30; ++i)
+            dist[i] = reverse(i, 5);
+        for (unsigned l = 3, s = 0; l <= 258; ++l)
+        {
+            while (s + 1 < 29 && len_base[s + 1] <= l)
+                ++s;
+            len_sym[l] = s;
+        }
+    }
+    static unsigned reverse(unsigned code, unsigned bits)
+    {
+        unsigned r = 0;
+        while (bits--)
+        {
+            r = (r << 1) | (code & 1);
+            code >>= 1;
+        }
+        return r;
+    }
+};
+
+static const fixed_codes codes;
+
+class bit_writer
+{
+public:
+    std::string out;
+    void put(uint32_t value, unsigned bits)
+    {
+        acc |= static_cast<uint64_t>(value) << count;
+        count += bits;
+        while (count >= 8)
+        {
+            out.push_back(static_cast<char>(acc & 0xff));
+            acc >>= 8;
+            count -= 8;
+        }
+    }
+    void align()
+    {
+        if (count)
+            put(0, 8 - count);
+    }
+
+private:
+    uint64_t acc = 0;
+    unsigned count = 0;
+};
+
+static void literal(bit_writer &bits, unsigned char c)
+{
+    bits.put(codes.lit[c], codes.lit_bits[c]);
+}
+
+static void match(bit_writer &bits, unsigned len, unsigned dist)
+{
+    unsigned s = codes.len_sym[len];
+    bits.put(codes.lit[257 + s], codes.lit_bits[257 + s]);
+    bits.put(len - len_base[s], len_extra[s]);
+    unsigned d = std::upper_bound(dist_base, dist_base + 30, dist) - dist_base - 1;
+    bits.put(codes.dist[d], 5);
+    bits.put(dist - dist_base[d], dist_extra[d]);
+}
+
+static void deflate_store(bit_writer &bits, const std::string &data)
+{
+    for (size_t i = 0; i < data.size(); i += 65535)
+    {
+        unsigned n = std::min<size_t>(65535, data.size() - i);
+        bits.put(0, 3); // not final, stored
+        bits.align();
+        bits.put(n, 16);
+        bits.put(~n & 0xffff, 16);
+        bits.out.append(data, i, n);
+    }
+}
+
+static void deflate_rle(bit_writer &bits, const std::string &data)
+{
+    auto p = reinterpret_cast<const unsigned char *>(data.data());
+    size_t n = data.size();
+    bits.put(2, 3); // not final, fixed Huffman
+    for (size_t i = 0; i < n;)
+    {
+        size_t run = 0;
+        if (i > 0)
+            while (run < 258 && i + run < n && p[i + run] == p[i - 1])
+                ++run;
+        if (run >= 3)
+        {
+            match(bits, run, 1);
+            i += run;
+        }
+        else
+            literal(bits, p[i++]);
+    }
+    bits.put(codes.lit[256], codes.lit_bits[256]);
+}
+
+static void deflate_lz(bit_writer &bits, const std::string &data, unsigned depth)
+{
+    const unsigned window = 32768, hash_size = 1 << 15;
+    auto p = reinterpret_cast<const unsigned char *>(data.data());
+    size_t n = data.size();
+    std::vector<int> head(hash_size, -1), prev(n);
+    auto hash = [p](size_t i)
+    { return ((p[i] << 10) ^ (p[i + 1] << 5) ^ p[i + 2]) & (hash_size - 1); };
+    auto insert = [&](size_t i)
+    {
+        auto h = hash(i);
+        prev[i] = head[h];
+        head[h] = i;
+    };
+
+    bits.put(2, 3); // not final, fixed Huffman
+    for (size_t i = 0; i < n;)
+    {
+        unsigned best = 0, best_dist = 0;
+        if (i + 3 <= n)
+        {
+            unsigned limit = std::min<size_t>(258, n - i);
+            int j = head[hash(i)];
+            for (unsigned k = 0; k < depth && j >= 0 && i - j <= window; ++k, j = prev[j])
+            {
+                unsigned len = 0;
+                while (len < limit && p[j + len] == p[i + len])
+                    ++len;
+                if (len > best)
+                {
+                    best = len;
+                    best_dist = i - j;
+                    if (len == limit)
+                        break;
+                }
+            }
+        }
+        if (best >= 3)
+        {
+            match(bits, best, best_dist);
+            for (size_t end = i + best; i < end; ++i)
+                if (i + 3 <= n)
+                    insert(i);
+        }
+        else
+        {
+            if (i + 3 <= n)
+                insert(i);
+            literal(bits, p[i++]);
+        }
+    }
+    bits.put(codes.lit[256], codes.lit_bits[256]);
+}
+
+static uint32_t adler32(const std::string &data)
+{
+    uint32_t a = 1, b = 0;
+    for (size_t i = 0; i < data.size();)
+    {
+        // largest run that cannot overflow b before the modulo
+        for (size_t end = std::min(data.size(), i + 5552); i < end; ++i)
+        {
+            a += static_cast<unsigned char>(data[i]);
+            b += a;
+        }
+        a %= 65521;
+        b %= 65521;
+    }
+    return (b << 16) | a;
+}
+
+// checksum of two concatenated pieces, as zlib's adler32_combine
+static uint32_t adler32_combine(uint32_t a1, uint32_t a2, size_t len2)
+{
+    const uint32_t base = 65521;
+    uint32_t rem = len2 % base;
+    uint32_t sum1 = a1 & 0xffff;
+    uint32_t sum2 = (static_cast<uint64_t>(rem) * sum1) % base;
+    sum1 += (a2 & 0xffff) + base - 1;
+    sum2 += (a1 >> 16) + (a2 >> 16) + base - rem;
+    if (sum1 >= base)
+        sum1 -= base;
+    if (sum1 >= base)
+        sum1 -= base;
+    if (sum2 >= 2 * base)
+        sum2 -= 2 * base;
+    if (sum2 >= base)
+        sum2 -= base;
+    return (sum2 << 16) | sum1;
+}
+
+static uint32_t crc32(uint32_t crc, const char *data, size_t n)
+{
+    static const struct table
+    {
+        uint32_t t[256];
+        table()
+        {
+            for (uint32_t i = 0; i < 256; ++i)
+            {
+                uint32_t c = i;
+                for (int k = 0; k < 8; ++k)
+                    c = c & 1 ? 0xedb88320 ^ (c >> 1) : c >> 1;
+                t[i] = c;
+            }
+        }
+    } crc_table;
+    crc = ~crc;
+    while (n--)
+        crc = crc_table.t[(crc ^ static_cast<unsigned char>(*data++)) & 0xff] ^ (crc >> 8);
+    return ~crc;
+}
+
+static void put_u32(std::string &s, uint32_t v)
+{
+    s.push_back(static_cast<char>(v >> 24));
+    s.push_back(static_cast<char>(v >> 16));
+    s.push_back(static_cast<char>(v >> 8));
+    s.push_back(static_cast<char>(v));
+}
+
+static void write_chunk(std::ostream &out, const char *type, const std::string &data)
+{
+    std::string head;
+    put_u32(head, data.size());
+    head.append(type, 4);
+    auto crc = crc32(crc32(0, type, 4), data.data(), data.size());
+    std::string tail;
+    put_u32(tail, crc);
+    out.write(head.data(), head.size());
+    out.write(data.data(), data.size());
+    out.write(tail.data(), tail.size());
+}
+
+static unsigned char paeth(int a, int b, int c)
+{
+    int p = a + b - c, pa = std::abs(p - a), pb = std::abs(p - b), pc = std::abs(p - c);
+    if (pa <= pb && pa <= pc)
+        return a;
+    return pb <= pc ? b : c;
+}
+
+// filters rows [y0, y1) into the zlib payload of one piece; the row above
+// is taken from above if given, otherwise read again through row
+static std::string filter_rows(unsigned width, unsigned y0, unsigned y1,
+                               const png_row_reader &row, int level, const unsigned char *above)
+{
+    size_t stride = static_cast<size_t>(width) * 4;
+    std::vector<unsigned char> cur(stride), prev(stride), line(stride);
+    std::string data;
+    data.reserve((stride + 1) * (y1 - y0));
+    if (above)
+        prev.assign(above, above + stride);
+    else if (y0 > 0 && level >= PNG_LEVEL_BEST)
+        row(y0 - 1, prev.data());
+
+    for (unsigned y = y0; y < y1; ++y)
+    {
+        row(y, cur.data());
+        unsigned char type = 0;
+        if (level == PNG_LEVEL_STORE)
+        {
+            line = cur;
+        }
+        else if (level < PNG_LEVEL_BEST)
+        {
+            type = 1;
+            for (size_t i = 0; i < stride; ++i)
+                line[i] = cur[i] - (i >= 4 ? cur[i - 4] : 0);
+        }
+        else
+        {
+            // pick the filter with the smallest sum of signed residuals
+            long best = -1;
+            for (unsigned char f = 0; f < 5; ++f)
+            {
+                if (f >= 2 && y == 0)
+                    break;
+                long cost = 0;
+                for (size_t i = 0; i < stride; ++i)
+                {
+                    int a = i >= 4 ? cur[i - 4] : 0, b = prev[i], c = i >= 4 ? prev[i - 4] : 0;
+                    unsigned char pred = f == 0 ? 0 : f == 1 ? a : f == 2 ? b : f == 3 ? (a + b) / 2 : paeth(a, b, c);
+                    cost += std::abs(static_cast<signed char>(cur[i] - pred));
+                }
+                if (best < 0 || cost < best)
+                {
+                    best = cost;
+                    type = f;
+                }
+            }
+            for (size_t i = 0; i < stride; ++i)
+            {
+                int a = i >= 4 ? cur[i - 4] : 0, b = prev[i], c = i >= 4 ? prev[i - 4] : 0;
+                unsigned char pred = type == 0 ? 0 : type == 1 ? a : type == 2 ? b : type == 3 ? (a + b) / 2 : paeth(a, b, c);
+                line[i] = cur[i] - pred;
+            }
+            std::swap(prev, cur);
+        }
+        data.push_back(static_cast<char>(type));
+        data.append(line.begin(), line.end());
+    }
+    return data;
+}
+
+struct png_piece
+{
+    std::string deflated;
+    uint32_t adler;
+    size_t size;
+};
+
+static png_piece compress_rows(unsigned width, unsigned y0, unsigned y1,
+                               const png_row_reader &row, int level, const unsigned char *above)
+{
+    auto data = filter_rows(width, y0, y1, row, level, above);
+    bit_writer bits;
+    if (level == PNG_LEVEL_STORE)
+        deflate_store(bits, data);
+    else if (level == PNG_LEVEL_RLE)
+        deflate_rle(bits, data);
+    else
+        deflate_lz(bits, data, level == PNG_LEVEL_FAST ? 1 : 64);
+    // empty stored block to end on a byte boundary, so pieces concatenate
+    bits.put(0, 3);
+    bits.align();
+    bits.put(0, 16);
+    bits.put(0xffff, 16);
+    return {std::move(bits.out), adler32(data), data.size()};
+}
+
+png_writer::png_writer(std::ostream &out, unsigned width, unsigned height, int level, unsigned threads)
+    : out(out), width{width}, height{height}, level{level}, adler{1},
+      job{nullptr}, next{0}, pieces{0}, active{0}, stopping{false}
+{
+    out.write("\x89PNG\r\n\x1a\n", 8);
+    std::string header;
+    put_u32(header, width);
+    put_u32(header, height);
+    header += std::string("\x08\x06\x00\x00\x00", 5); // 8-bit RGBA, no interlace
+    write_chunk(out, "IHDR", header);
+    write_chunk(out, "IDAT", "\x78\x01");
+
+    // the calling thread deflates too, so start one helper fewer
+    if (HAVE_THREADS)
+    {
+        unsigned n = threads ? threads : std::max(1u, std::thread::hardware_concurrency());
+        n = std::min((height + PNG_CHUNK_ROWS - 1) / PNG_CHUNK_ROWS, n);
+        for (unsigned i = 1; i < n; ++i)
+            workers.emplace_back(&png_writer::work, this);
+    }
+}
+
+png_writer::~png_writer()
+{
+    stop();
+}
+
+void png_writer::work()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;)
+    {
+        wake.wait(lock, [this]()
+                  { return stopping || (job && next < pieces); });
+        if (stopping)
+            return;
+        auto task = job;
+        auto i = next++;
+        ++active;
+        lock.unlock();
+        (*task)(i);
+        lock.lock();
+        if (--active == 0)
+            done.notify_all();
+    }
+}
+
+void png_writer::stop()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+    workers.clear();
+}
+
+void png_writer::write(unsigned y_begin, unsigned y_end, const png_row_reader &row)
+{
+    unsigned n = (y_end - y_begin + PNG_CHUNK_ROWS - 1) / PNG_CHUNK_ROWS;
+    // the row above the band may be gone already
+    const unsigned char *above = y_begin > 0 && level >= PNG_LEVEL_BEST ? last.data() : nullptr;
+    std::vector<png_piece> finished(n);
+    std::vector<char> ready(n);
+
+    std::function<void(unsigned)> compress = [&](unsigned i)
+    {
+        auto y0 = y_begin + i * PNG_CHUNK_ROWS, y1 = std::min(y_end, y0 + PNG_CHUNK_ROWS);
+        auto piece = compress_rows(width, y0, y1, row, level, i ? nullptr : above);
+        std::lock_guard<std::mutex> lock(mutex);
+        finished[i] = std::move(piece);
+        ready[i] = 1;
+        done.notify_all();
+    };
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        job = &compress;
+        next = 0;
+        pieces = n;
+    }
+    wake.notify_all();
+
+    // write pieces in order as soon as each one is finished, helping out
+    // instead of only waiting
+    std::unique_lock<std::mutex> lock(mutex);
+    auto retire = [&]()
+    {
+        // helpers may still be returning from the last pieces
+        next = pieces;
+        done.wait(lock, [this]()
+                  { return active == 0; });
+        job = nullptr;
+    };
+    try
+    {
+        for (unsigned i = 0; i < n; ++i)
+        {
+            while (!ready[i])
+            {
+                if (next < pieces)
+                {
+                    auto k = next++;
+                    lock.unlock();
+                    compress(k);
+                    lock.lock();
+                }
+                else
+                    done.wait(lock);
+            }
+            auto piece = std::move(finished[i]);
+            lock.unlock();
+            adler = adler32_combine(adler, piece.adler, piece.size);
+            write_chunk(out, "IDAT", piece.deflated);
+            lock.lock();
+        }
+    }
+    catch (...)
+    {
+        if (!lock)
+            lock.lock();
+        retire();
+        throw;
+    }
+    retire();
+    lock.unlock();
+
+    if (level >= PNG_LEVEL_BEST && y_end > y_begin)
+    {
+        last.resize(static_cast<size_t>(width) * 4);
+        row(y_end - 1, last.data());
+    }
+}
+
+void png_writer::finish()
+{
+    stop();
+    // final empty fixed Huffman block, then the zlib checksum
+    std::string tail("\x03\x00", 2);
+    put_u32(tail, adler);
+    write_chunk(out, "IDAT", tail);
+    write_chunk(out, "IEND", "");
+}
+
+void write_png(std::ostream &out, unsigned width, unsigned height,
+               const png_row_reader &row, int level, unsigned threads)
+{
+    png_writer png(out, width, height, level, threads);
+    png.write(0, height, row);
+    png.finish();
+}
+
+class bit_reader
+{
+public:
+    bit_reader(const std::string &in, size_t pos) : in(in), pos{pos} {}
+    unsigned get(unsigned bits)
+    {
+        while (count < bits)
+        {
+            if (pos >= in.size())
+                throw std::runtime_error("png: image data ends early");
+            acc |= static_cast<uint64_t>(static_cast<unsigned char>(in[pos++])) << count;
+            count += 8;
+        }
+        unsigned value = acc & ((1ull << bits) - 1);
+        acc >>= bits;
+        count -= bits;
+        return value;
+    }
+    // drops the rest of the current byte and hands out whole bytes
+    size_t align()
+    {
+        acc = 0;
+        count = 0;
+        return pos;
+    }
+    void skip(size_t n) { pos += n; }
+
+private:
+    const std::string &in;
+    size_t pos;
+    uint64_t acc = 0;
+    unsigned count = 0;
+};
+
+// canonical Huffman code, decoded one bit at a time as in zlib's puff
+struct huffman
+{
+    unsigned short count[16], symbol[288];
+    huffman(const unsigned char *lengths, unsigned n)
+    {
+        std::fill_n(count, 16, 0);
+        for (unsigned i = 0; i < n; ++i)
+            ++count[lengths[i]];
+        int left = 1;
+        for (unsigned len = 1; len < 16; ++len)
+        {
+            left = (left << 1) - count[len];
+            if (left < 0)
+                throw std::runtime_error("png: bad Huffman code");
+        }
+        unsigned short offset[16] = {0};
+        for (unsigned len = 1; len < 15; ++len)
+            offset[len + 1] = offset[len] + count[len];
+        for (unsigned i = 0; i < n; ++i)
+            if (lengths[i])
+                symbol[offset[lengths[i]]++] = i;
+    }
+    unsigned decode(bit_reader &bits) const
+    {
+        int code = 0, first = 0, index = 0;
+        for (unsigned len = 1; len < 16; ++len)
+        {
+            code |= bits.get(1);
+            int n = count[len];
+            if (code - first < n)
+                return symbol[index + code - first];
+            index += n;
+            first = (first + n) << 1;
+            code <<= 1;
+        }
+        throw std::runtime_error("png: bad Huffman code");
+    }
+};
+
+static void inflate_block(bit_reader &bits, std::string &out, size_t limit, const huffman &lit, const huffman &dist)
+{
+    for (;;)
+    {
+        unsigned sym = lit.decode(bits);
+        if (sym < 256)
+        {
+            if (out.size() >= limit)
+                throw std::runtime_error("png: too much image data");
+            out.push_back(static_cast<char>(sym));
+            continue;
+        }
+        if (sym == 256)
+            return;
+        sym -= 257;
+        if (sym >= 29)
+            throw std::runtime_error("png: bad length code");
+        size_t len = len_base[sym] + bits.get(len_extra[sym]);
+        unsigned d = dist.decode(bits);
+        if (d >= 30)
+            throw std::runtime_error("png: bad distance code");
+        size_t back = dist_base[d] + bits.get(dist_extra[d]);
+        if (back > out.size())
+            throw std::runtime_error("png: distance too far back");
+        if (len > limit - out.size())
+            throw std::runtime_error("png: too much image data");
+        // copied a byte at a time, since a match may overlap itself
+        for (size_t from = out.size() - back; len--;)
+            out.push_back(out[from++]);
+    }
+}
+
+// decompresses a zlib stream, refusing to grow past limit bytes
+static std::string inflate(const std::string &in, size_t limit)
+{
+    if (in.size() < 2 || (in[0] & 0x0f) != 8 ||
+        ((static_cast<unsigned char>(in[0]) << 8) | static_cast<unsigned char>(in[1])) % 31 || (in[1] & 0x20))
+        throw std::runtime_error("png: bad zlib header");
+    bit_reader bits(in, 2);
+    std::string out;
+    // deflate expands at most about 1032 times, whatever the header claims
+    out.reserve(std::min(limit, in.size() * 1032));
+    static const unsigned char order[19] = {16, 17, 18, 0, 8, 7, 9, 6, 10, 5, 11, 4, 12, 3, 13, 2, 14, 1, 15};
+    unsigned last;
+    do
+    {
+        last = bits.get(1);
+        unsigned type = bits.get(2);
+        if (type == 0)
+        {
+            auto pos = bits.align();
+            if (pos + 4 > in.size())
+                throw std::runtime_error("png: image data ends early");
+            auto byte = [&](size_t i)
+            { return static_cast<unsigned char>(in[pos + i]); };
+            unsigned n = byte(0) | byte(1) << 8;
+            if (static_cast<unsigned>(byte(2) | byte(3) << 8) != (~n & 0xffff))
+                throw std::runtime_error("png: bad stored block");
+            if (pos + 4 + n > in.size())
+                throw std::runtime_error("png: image data ends early");
+            if (n > limit - out.size())
+                throw std::runtime_error("png: too much image data");
+            out.append(in, pos + 4, n);
+            bits.skip(4 + n);
+        }
+        else if (type == 1)
+        {
+            unsigned char lengths[288 + 30];
+            std::fill_n(lengths, 144, 8);
+            std::fill_n(lengths + 144, 112, 9);
+            std::fill_n(lengths + 256, 24, 7);
+            std::fill_n(lengths + 280, 8, 8);
+            std::fill_n(lengths + 288, 30, 5);
+            static const huffman lit(lengths, 288), dist(lengths + 288, 30);
+            inflate_block(bits, out, limit, lit, dist);
+        }
+        else if (type == 2)
+        {
+            unsigned nlit = bits.get(5) + 257, ndist = bits.get(5) + 1, ncode = bits.get(4) + 4;
+            if (nlit > 286 || ndist > 30)
+                throw std::runtime_error("png: bad code lengths");
+            unsigned char lengths[286 + 30] = {0};
+            for (unsigned i = 0; i < ncode; ++i)
+                lengths[order[i]] = bits.get(3);
+            huffman code(lengths, 19);
+            std::fill_n(lengths, 19, 0);
+            for (unsigned i = 0; i < nlit + ndist;)
+            {
+                unsigned sym = code.decode(bits), len = 0, repeat;
+                if (sym < 16)
+                {
+                    lengths[i++] = sym;
+                    continue;
+                }
+                if (sym == 16)
+                {
+                    if (i == 0)
+                        throw std::runtime_error("png: bad code lengths");
+                    len = lengths[i - 1];
+                    repeat = 3 + bits.get(2);
+                }
+                else if (sym == 17)
+                    repeat = 3 + bits.get(3);
+                else
+                    repeat = 11 + bits.get(7);
+                if (i + repeat > nlit + ndist)
+                    throw std::runtime_error("png: bad code lengths");
+                while (repeat--)
+                    lengths[i++] = len;
+            }
+            if (!lengths[256])
+                throw std::runtime_error("png: bad code lengths");
+            inflate_block(bits, out, limit, huffman(lengths, nlit), huffman(lengths + nlit, ndist));
+        }
+        else
+            throw std::runtime_error("png: bad block type");
+    } while (!last);
+
+    auto pos = bits.align();
+    if (pos + 4 > in.size())
+        throw std::runtime_error("png: image data ends early");
+    uint32_t sum = 0;
+    for (size_t i = 0; i < 4; ++i)
+        sum = (sum << 8) | static_cast<unsigned char>(in[pos + i]);
+    if (sum != adler32(out))
+        throw std::runtime_error("png: bad checksum");
+    return out;
+}
+
+static uint32_t get_u32(const std::string &s, size_t pos)
+{
+    uint32_t v = 0;
+    for (size_t i = 0; i < 4; ++i)
+        v = (v << 8) | static_cast<unsigned char>(s[pos + i]);
+    return v;
+}
+
+// the colour type, bit depth and the chunks that give colours meaning
+struct png_format
+{
+    unsigned color, depth, channels;
+    std::string palette, transparent;
+};
+
+// undoes the filters of an h-row image of w pixels starting at data[pos];
+// returns the unfiltered rows without their filter type bytes
+static std::vector<unsigned char> unfilter(const std::string &data, size_t &pos, unsigned w, unsigned h,
+                                           const png_format &format)
+{
+    size_t bits = format.channels * format.depth;
+    size_t stride = (w * bits + 7) / 8, bpp = std::max<size_t>(1, bits / 8);
+    std::vector<unsigned char> rows(stride * h);
+    for (unsigned y = 0; y < h; ++y, pos += stride + 1)
+    {
+        unsigned char type = data[pos];
+        auto src = reinterpret_cast<const unsigned char *>(&data[pos + 1]);
+        auto cur = &rows[y * stride], prev = y ? cur - stride : nullptr;
+        for (size_t i = 0; i < stride; ++i)
+        {
+            int a = i >= bpp ? cur[i - bpp] : 0, b = prev ? prev[i] : 0, c = prev && i >= bpp ? prev[i - bpp] : 0;
+            switch (type)
+            {
+            case 0:
+                cur[i] = src[i];
+                break;
+            case 1:
+                cur[i] = src[i] + a;
+                break;
+            case 2:
+                cur[i] = src[i] + b;
+                break;
+            case 3:
+                cur[i] = src[i] + (a + b) / 2;
+                break;
+            case 4:
+                cur[i] = src[i] + paeth(a, b, c);
+                break;
+            default:
+                throw std::runtime_error("png: bad filter type");
+            }
+        }
+    }
+    return rows;
+}
+
+// converts pixel x of an unfiltered row to 8-bit RGBA
+static void to_rgba(const unsigned char *row, unsigned x, const png_format &format, unsigned char *rgba)
+{
+    unsigned v[4] = {0}, depth = format.depth;
+    for (unsigned k = 0; k < format.channels; ++k)
+    {
+        size_t bit = (static_cast<size_t>(x) * format.channels + k) * depth;
+        if (depth == 16)
+            v[k] = row[bit / 8] << 8 | row[bit / 8 + 1];
+        else
+            v[k] = row[bit / 8] >> (8 - depth - bit % 8) & ((1 << depth) - 1);
+    }
+    // the top 8 bits of a 16-bit sample, or a small one spread over 0..255
+    auto scale = [depth](unsigned s)
+    { return static_cast<unsigned char>(depth == 16 ? s >> 8 : s * 255 / ((1 << depth) - 1)); };
+    auto &t = format.transparent;
+    auto key = [&](unsigned i)
+    { return static_cast<unsigned>(static_cast<unsigned char>(t[2 * i]) << 8 | static_cast<unsigned char>(t[2 * i + 1])); };
+    switch (format.color)
+    {
+    case 0:
+        rgba[0] = rgba[1] = rgba[2] = scale(v[0]);
+        rgba[3] = t.size() >= 2 && v[0] == key(0) ? 0 : 255;
+        break;
+    case 2:
+        for (int k = 0; k < 3; ++k)
+            rgba[k] = scale(v[k]);
+        rgba[3] = t.size() >= 6 && v[0] == key(0) && v[1] == key(1) && v[2] == key(2) ? 0 : 255;
+        break;
+    case 3:
+        if (3 * v[0] + 2 >= format.palette.size())
+            throw std::runtime_error("png: colour index out of range");
+        for (int k = 0; k < 3; ++k)
+            rgba[k] = format.palette[3 * v[0] + k];
+        rgba[3] = v[0] < t.size() ? static_cast<unsigned char>(t[v[0]]) : 255;
+        break;
+    case 4:
+        rgba[0] = rgba[1] = rgba[2] = scale(v[0]);
+        rgba[3] = scale(v[1]);
+        break;
+    case 6:
+        for (int k = 0; k < 4; ++k)
+            rgba[k] = scale(v[k]);
+        break;
+    }
+}
+
+std::vector<unsigned char> read_png(const std::string &bytes, unsigned &width, unsigned &height)
+{
+    if (bytes.compare(0, 8, "\x89PNG\r\n\x1a\n", 8))
+        throw std::runtime_error("png: not a PNG file");
+    png_format format;
+    std::string compressed;
+    unsigned interlace = 0;
+    bool header = false, end = false;
+    for (size_t pos = 8; !end;)
+    {
+        if (pos + 12 > bytes.size())
+            throw std::runtime_error("png: file ends early");
+        size_t n = get_u32(bytes, pos);
+        if (n > bytes.size() - pos - 12)
+            throw std::runtime_error("png: file ends early");
+        auto type = bytes.substr(pos + 4, 4);
+        if (crc32(0, &bytes[pos + 4], n + 4) != get_u32(bytes, pos + 8 + n))
+            throw std::runtime_error("png: bad " + type + " checksum");
+        auto data = bytes.substr(pos + 8, n);
+        pos += n + 12;
+        if (type == "IHDR" && n == 13)
+        {
+            width = get_u32(data, 0);
+            height = get_u32(data, 4);
+            format.depth = static_cast<unsigned char>(data[8]);
+            format.color = static_cast<unsigned char>(data[9]);
+            interlace = static_cast<unsigned char>(data[12]);
+            static const unsigned channels[] = {1, 0, 3, 1, 2, 0, 4};
+            format.channels = format.color < 7 ? channels[format.color] : 0;
+            auto d = format.depth;
+            bool valid = format.channels && (d == 1 || d == 2 || d == 4 || d == 8 || d == 16) &&
+                         (format.color == 0 || (format.color == 3 ? d <= 8 : d >= 8));
+            if (!valid || data[10] || data[11] || interlace > 1 || !width || !height)
+                throw std::runtime_error("png: unsupported format");
+            header = true;
+        }
+        else if (!header)
+            throw std::runtime_error("png: missing IHDR");
+        else if (type == "PLTE")
+            format.palette = data;
+        else if (type == "tRNS")
+            format.transparent = data;
+        else if (type == "IDAT")
+            compressed += data;
+        else if (type == "IEND")
+            end = true;
+        else if (!(type[0] & 0x20))
+            throw std::runtime_error("png: unknown critical chunk " + type);
+    }
+
+    // Adam7 passes as x, y offsets and steps; a plain image is one pass
+    static const unsigned adam7[7][4] = {{0, 0, 8, 8}, {4, 0, 8, 8}, {0, 4, 4, 8}, {2, 0, 4, 4},
+                                         {0, 2, 2, 4}, {1, 0, 2, 2}, {0, 1, 1, 2}};
+    static const unsigned plain[1][4] = {{0, 0, 1, 1}};
+    auto passes = interlace ? adam7 : plain;
+    unsigned count = interlace ? 7 : 1;
+
+    std::vector<unsigned char> rgba;
+    if (width > rgba.max_size() / 8 / height)
+        throw std::runtime_error("png: image too large");
+    size_t expected = 0;
+    for (unsigned p = 0; p < count; ++p)
+    {
+        size_t w = (width - passes[p][0] + passes[p][2] - 1) / passes[p][2];
+        size_t h = (height - passes[p][1] + passes[p][3] - 1) / passes[p][3];
+        if (w && h)
+            expected += h * ((w * format.channels * format.depth + 7) / 8 + 1);
+    }
+    auto data = inflate(compressed, expected);
+    if (data.size() != expected)
+        throw std::runtime_error("png: image data ends early");
+
+    rgba.resize(static_cast<size_t>(width) * height * 4);
+    size_t pos = 0;
+    for (unsigned p = 0; p < count; ++p)
+    {
+        unsigned x0 = passes[p][0], y0 = passes[p][1], dx = passes[p][2], dy = passes[p][3];
+        unsigned w = (width - x0 + dx - 1) / dx, h = (height - y0 + dy - 1) / dy;
+        if (!w || !h)
+            continue;
+        auto rows = unfilter(data, pos, w, h, format);
+        size_t stride = rows.size() / h;
+        for (unsigned y = 0; y < h; ++y)
+            for (unsigned x = 0; x < w; ++x)
+                to_rgba(&rows[y * stride], x, format,
+                        &rgba[((static_cast<size_t>(y0) + y * dy) * width + x0 + x * dx) * 4]);
+    }
+    return rgba;
+}
@@ -0,0 +1,64 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// compression levels for write_png
+#define PNG_LEVEL_STORE 0 // stored blocks, no compression
+#define PNG_LEVEL_RLE 1   // runs of repeated bytes only
+#define PNG_LEVEL_FAST 2  // LZ77 with a single hash probe
+#define PNG_LEVEL_BEST 3  // LZ77 with hash chains and per-row filter choice
+#define PNG_LEVEL_DEFAULT PNG_LEVEL_FAST
+
+// rows per independently deflated piece of the image
+#define PNG_CHUNK_ROWS 32
+
+// fills rgba with row y of the image, 4 bytes per pixel
+using png_row_reader = std::function<void(unsigned y, unsigned char *rgba)>;
+
+// streams an 8-bit RGBA PNG whose rows arrive in bands, top to bottom;
+// each band is split into pieces of PNG_CHUNK_ROWS rows that are deflated
+// on their own, on up to threads threads (0 for one per core); the helper
+// threads are started once and serve every band until finish
+class png_writer
+{
+public:
+    png_writer(std::ostream &out, unsigned width, unsigned height,
+               int level = PNG_LEVEL_DEFAULT, unsigned threads = 0);
+    ~png_writer();
+    // rows [y0, y1) must directly follow the previous band
+    void write(unsigned y0, unsigned y1, const png_row_reader &row);
+    void finish();
+
+private:
+    std::ostream &out;
+    unsigned width, height;
+    int level;
+    uint32_t adler;
+    std::vector<unsigned char> last; // bottom row of the previous band
+
+    std::vector<std::thread> workers;
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    const std::function<void(unsigned)> *job; // deflates piece i of the band
+    unsigned next, pieces, active;
+    bool stopping;
+    void work();
+    void stop();
+};
+
+// writes a whole image in one band; rows are fetched on demand and every
+// PNG_CHUNK_ROWS of them are deflated on their own, on up to threads
+// threads (0 for one per core)
+void write_png(std::ostream &out, unsigned width, unsigned height,
+               const png_row_reader &row, int level = PNG_LEVEL_DEFAULT, unsigned threads = 0);
+
+// decodes a whole PNG file of any colour type and bit depth, interlaced
+// or not, to 8-bit RGBA, 4 bytes per pixel and row after row; throws
+// std::runtime_error if bytes are not a PNG this can read
+std::vector<unsigned char> read_png(const std::string &bytes, unsigned &width, unsigned &height);
@@ -1,3 +1,4 @@
+#include <fstream>
 #include "rasterize.hpp"
 
 std::ostream &operator<<(std::ostream &os, const vec &v)
@@ -75,38 +76,122 @@ vec operator/(const vec &v, double k)
     return res;
 }
 
-rasterizer::rasterizer()
+rasterizer::rasterizer() : rasterizer(texture_cache::shared()) {}
+
+rasterizer::rasterizer(texture_cache &textures)
     : width{0}, height{0},
       r{255.0}, g{255.0}, b{255.0}, a{1.0},
       s{0.0}, t{0.0},
       fsaa_level{1},
+      depth_enabled{false},
+      srgb_enabled{false},
+      perspective_enabled{false},
+      frustum_clipping_enabled{false},
+      cull_enabled{false},
+      texture_enabled{false},
+      decals_enabled{false},
+      deferred_enabled{false},
+      texture_opaque{false},
+      textures(textures),
+      depth_buf{1.0},
+      id_buf{0},
+      drawing_id{0},
+      ids_pending{false},
       clip_planes{
           {1.0, 0, 0, 1.0},
           {-1.0, 0, 0, 1.0},
           {0, 1.0, 0, 1.0},
           {0, -1.0, 0, 1.0},
           {0, 0, 1.0, 1.0},
-          {0, 0, -1.0, 1.0}}
+          {0, 0, -1.0, 1.0}},
+      matrices{{{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1}}},
+      identity{true},
+      tile_size{0},
+      tiles_x{0}, tiles_y{0},
+      origin_x{0}, origin_y{0},
+      current_draw{0}
 {
     // std::cout << "FSAA::::" << fsaa_level;
 }
 
-std::vector<unsigned char> &rasterizer::data()
+buffer_storage<unsigned char> &rasterizer::data()
 {
     return output_buf.data();
 }
 
+void rasterizer::save(std::string &filename, int level, unsigned threads)
+{
+    if (!tile_size)
+    {
+        output();
+        output_buf.save(filename, level, threads);
+        return;
+    }
+
+    std::ofstream file(filename, std::ios::binary);
+    if (!file)
+    {
+        throw std::runtime_error("cannot write " + filename);
+    }
+    png_writer png(file, width, height, level, threads);
+    render_bands([&](unsigned y, frame_buffer<unsigned char> &band)
+                 { png.write(y, y + band.height, [&](unsigned row, unsigned char *rgba)
+                             { band.read_row(row - y, rgba); }); });
+    png.finish();
+    if (!file)
+    {
+        throw std::runtime_error("cannot write " + filename);
+    }
+}
+
 void rasterizer::resize(int w, int h)
 {
+    flush_triangles();
     width = w;
     height = h;
-    output_buf = frame_buffer<unsigned char>(w, h);
-    render_buf = frame_buffer<double>(w * fsaa_level, h * fsaa_level);
-    depth_buf = depth_buffer(w * fsaa_level, h * fsaa_level);
+    // tiled output is only assembled on demand
+    output_buf.resize(tile_size ? 0 : w, tile_size ? 0 : h);
+    allocate_buffers();
+}
+
+void rasterizer::enable_tiling(int size)
+{
+    flush_triangles();
+    tile_size = size;
+    output_buf.resize(tile_size ? 0 : width, tile_size ? 0 : height);
+    allocate_buffers();
+}
+
+void rasterizer::allocate_buffers()
+{
+    // like a full-size reallocation, this drops everything drawn so far
+    primitives.clear();
+    states.clear();
+    bins.clear();
+    dirty.clear();
+    draws.clear();
+    draw_matrices.clear();
+    origin_x = origin_y = 0;
+    ids_pending = false;
+    unsigned w = width * fsaa_level, h = height * fsaa_level;
+    if (tile_size)
+    {
+        tiles_x = (width + tile_size - 1) / tile_size;
+        tiles_y = (height + tile_size - 1) / tile_size;
+        bins.resize(tiles_x * tiles_y);
+        dirty.assign(tiles_x * tiles_y, 1);
+        w = std::min<unsigned>(w, tile_size * fsaa_level);
+        h = std::min<unsigned>(h, tile_size * fsaa_level);
+    }
+    // nothing is allocated or cleared until samples are actually drawn
+    render_buf.resize(w, h);
+    depth_buf.resize(w, h);
+    id_buf.resize(w, h);
 }
 
 void rasterizer::enable_depth()
 {
+    flush_triangles();
     depth_enabled = true;
 }
 
@@ -122,28 +207,34 @@ inline double linear_to_srgb(double c)
 
 void rasterizer::enable_srgb()
 {
+    flush_triangles();
     srgb_enabled = true;
+    // every tile is resolved with the final setting
+    dirty.assign(dirty.size(), 1);
 }
 
 void rasterizer::enable_perspective()
 {
+    flush_triangles();
     perspective_enabled = true;
 }
 
 void rasterizer::enable_frustum_clipping()
 {
+    flush_triangles();
     frustum_clipping_enabled = true;
 }
 
 void rasterizer::enable_fsaa(int level)
 {
+    flush_triangles();
     fsaa_level = level;
-    render_buf = frame_buffer<double>(width * level, height * level);
-    depth_buf = depth_buffer(width * level, height * level);
+    allocate_buffers();
 }
 
 void rasterizer::cull_face()
 {
+    flush_triangles();
     cull_enabled = true;
 }
 
@@ -152,16 +243,119 @@ void rasterizer::add_vec(double x, double y, double z, double w)
     vertices.push_back({x, y, z, w, r, g, b, a, s, t});
 }
 
-vec &rasterizer::nth_vertex(int i)
+size_t rasterizer::vertex_index(int i)
 {
     if (i == 0)
         throw std::out_of_range("index cannot be 0");
-    if (i < 0)
+    size_t k = i < 0 ? vertices.size() + i : i - 1;
+    if (k >= vertices.size())
+        throw std::out_of_range("vertex index out of range");
+    return k;
+}
+
+vec rasterizer::nth_vertex(int i)
+{
+    return clip_vertex(vertex_index(i));
+}
+
+// vertex i with its position through the vertex stage
+vec rasterizer::clip_vertex(size_t i)
+{
+    if (identity)
+        return vertices[i];
+    clip_space.update(vertices, matrices.back());
+    vec v = vertices[i];
+    v[0] = clip_space.x[i];
+    v[1] = clip_space.y[i];
+    v[2] = clip_space.z[i];
+    v[3] = clip_space.w[i];
+    return v;
+}
+
+// transforms the vertices added since the last update, all of them after
+// the matrix has changed
+void transformed_vertices::update(const std::vector<vec> &vertices, const matrix4 &m)
+{
+    if (m != matrix)
+    {
+        matrix = m;
+        count = 0;
+    }
+    auto n = vertices.size();
+    if (count >= n)
+        return;
+    x.resize(n);
+    y.resize(n);
+    z.resize(n);
+    w.resize(n);
+
+    double in[4][VERTEX_BATCH_SIZE];
+    for (size_t first = count; first < n; first += VERTEX_BATCH_SIZE)
     {
-        auto &v = vertices[vertices.size() + i];
-        return v;
+        auto k = std::min<size_t>(VERTEX_BATCH_SIZE, n - first);
+        for (size_t i = 0; i < k; ++i)
+        {
+            auto &v = vertices[first + i];
+            in[0][i] = v[0];
+            in[1][i] = v[1];
+            in[2][i] = v[2];
+            in[3][i] = v[3];
+        }
+        // one 4x4 kernel per output row over the whole block, so that it
+        // vectorizes
+        double *out[] = {&x[first], &y[first], &z[first], &w[first]};
+        for (int r = 0; r < 4; ++r)
+        {
+            const double m0 = m[r * 4], m1 = m[r * 4 + 1], m2 = m[r * 4 + 2], m3 = m[r * 4 + 3];
+            double *o = out[r];
+            for (size_t i = 0; i < k; ++i)
+                o[i] = m0 * in[0][i] + m1 * in[1][i] + m2 * in[2][i] + m3 * in[3][i];
+        }
     }
-    return vertices[i - 1];
+    count = n;
+}
+
+// transformed vertices are only dropped once they are needed under a
+// different matrix, so restoring the one they were made with keeps them
+void rasterizer::set_matrix(const matrix4 &m)
+{
+    if (m == matrices.back())
+        return;
+    flush_triangles();
+    matrices.back() = m;
+    identity = m == matrix4{{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1}};
+}
+
+void rasterizer::load_matrix(const matrix4 &m)
+{
+    set_matrix(m);
+}
+
+void rasterizer::multiply_matrix(const matrix4 &m)
+{
+    auto &a = matrices.back();
+    matrix4 product;
+    for (int r = 0; r < 4; ++r)
+        for (int c = 0; c < 4; ++c)
+            product[r * 4 + c] = a[r * 4] * m[c] + a[r * 4 + 1] * m[4 + c] +
+                                 a[r * 4 + 2] * m[8 + c] + a[r * 4 + 3] * m[12 + c];
+    set_matrix(product);
+}
+
+void rasterizer::push_matrix()
+{
+    matrices.push_back(matrices.back());
+}
+
+void rasterizer::pop_matrix()
+{
+    if (matrices.size() == 1)
+    {
+        throw std::out_of_range("matrix stack underflow");
+    }
+    // pending triangles still use the matrix that goes
+    set_matrix(matrices[matrices.size() - 2]);
+    matrices.pop_back();
 }
 
 void rasterizer::set_color(double _r, double _g, double _b, double _a)
@@ -180,32 +374,47 @@ void rasterizer::set_texcoord(double _s, double _t)
 
 void rasterizer::load_texture(std::string &filename)
 {
-    std::cout << filename << std::endl;
-    // lodepng::decode(texture.data(), texture.width, texture.height, filename, LCT_RGBA, 8);
-    // TODO: load png
-    texture.data() = std::vector<uint8_t>(10000);
-    for (int i = 0; i < 10000; ++i) texture.data()[i] = rand() % 256;
-    texture.height = 50;
-    texture.width = 50;
+    bind_texture(textures.load(filename));
+}
+
+void rasterizer::bind_texture(texture_ptr image)
+{
+    flush_triangles();
+    texture = image;
+    texture_opaque = texture && is_opaque(*texture);
 }
 
 void rasterizer::enable_texture()
 {
+    if (texture_enabled)
+        return;
+    flush_triangles();
     texture_enabled = true;
 }
 
 void rasterizer::disable_texture()
 {
+    if (!texture_enabled)
+        return;
+    flush_triangles();
     texture_enabled = false;
 }
 
 void rasterizer::enable_decals()
 {
+    flush_triangles();
     decals_enabled = true;
 }
 
+void rasterizer::enable_deferred()
+{
+    flush_triangles();
+    deferred_enabled = true;
+}
+
 void rasterizer::clip(double p1, double p2, double p3, double p4)
 {
+    flush_triangles();
     clip_planes.push_back({p1, p2, p3, p4});
     // clip_planes = {{p1, p2, p3, p4}};
 }
@@ -220,8 +429,8 @@ vec rasterizer::project(vec in)
         out[6] = srgb_to_linear(out[6] / 255.0);
     }
     auto w = out[3];
-    out[0] = (out[0] / w + 1) * render_buf.width / 2;
-    out[1] = (out[1] / w + 1) * render_buf.height / 2;
+    out[0] = (out[0] / w + 1) * (width * fsaa_level) / 2;
+    out[1] = (out[1] / w + 1) * (height * fsaa_level) / 2;
     out[2] /= w;
     out[3] = 1 / w;
     if (perspective_enabled)
@@ -235,21 +444,38 @@ vec rasterizer::project(vec in)
     return out;
 }
 
-template <class Operation>
-void dda_scan(vec a, vec b, int i, Operation f)
+dda_walker::dda_walker(vec a, vec b, int i) : p(a), end{a[i]}, axis{i}
 {
     if (a[i] == b[i])
         return;
     if (a[i] > b[i])
         std::swap(a, b);
-    auto s = (b - a) / (b[i] - a[i]);
-    for (auto p = a + (std::ceil(a[i]) - a[i]) * s; p[i] < b[i]; p += s)
-    {
-        f(p);
-    }
+    s = (b - a) / (b[i] - a[i]);
+    p = a + (std::ceil(a[i]) - a[i]) * s;
+    end = b[i];
+}
+
+bool dda_walker::done() const
+{
+    return !(p[axis] < end);
 }
 
-inline vec alpha_blend(vec src, vec dst)
+void dda_walker::step()
+{
+    // the same sums as p += s, without a new vector per sample
+    for (size_t j = 0; j < s.size(); ++j)
+        p[j] += s[j];
+}
+
+// steps along axis i from a to b
+template <class Operation>
+void dda_scan(vec a, vec b, int i, Operation f)
+{
+    for (dda_walker w(std::move(a), std::move(b), i); !w.done(); w.step())
+        f(w.p);
+}
+
+inline vec alpha_blend(const vec &src, const vec &dst)
 {
     // "over" operator
     auto a = src[3] + dst[3] * (1.0 - src[3]);
@@ -260,82 +486,186 @@ inline vec alpha_blend(vec src, vec dst)
     return {r, g, b, a};
 }
 
-void rasterizer::draw_pixel(vec v) // copy since it will be modified
+// the colour of a fragment before it is blended over the frame buffer
+static vec shade_fragment(const vec &v, bool texture_enabled, bool srgb_enabled, bool decals_enabled,
+                          const texture_ptr &texture)
 {
-    if (perspective_enabled)
+    if (!texture_enabled)
     {
-        for (size_t i = 4; i < v.size(); ++i)
-        {
-            v[i] /= v[3];
-        }
+        return {v[4], v[5], v[6], v[7]};
     }
 
+    // TODO: round ?? there are some differences...
+    auto s = v[8], t = v[9];
+    auto &tex = *texture;
+    int x = static_cast<int>(s * tex.width + 0.5) % tex.width;
+    int y = static_cast<int>(t * tex.height + 0.5) % tex.height;
+
+    vec cs = {
+        tex(x, y, 0) / 1.0,
+        tex(x, y, 1) / 1.0,
+        tex(x, y, 2) / 1.0,
+        tex(x, y, 3) / 255.0};
+
+    if (srgb_enabled)
+    {
+        cs[0] = srgb_to_linear(cs[0] / 255.0);
+        cs[1] = srgb_to_linear(cs[1] / 255.0);
+        cs[2] = srgb_to_linear(cs[2] / 255.0);
+    }
+    if (decals_enabled)
+    {
+        cs = alpha_blend(cs, {v[4], v[5], v[6], v[7]});
+    }
+    return cs;
+}
+
+void rasterizer::draw_pixel(const vec &v)
+{
+    // samples left of or above the resident tile wrap around and fail too
     unsigned x = v[0], y = v[1];
+    x -= origin_x;
+    y -= origin_y;
     if (x >= render_buf.width || y >= render_buf.height)
     {
         // TODO: this should only happen when drawing points
         return;
     }
 
-    vec cs, cd;
-    cd = {
+    if (depth_enabled && !(v[2] >= -1.0 && v[2] < depth_buf(x, y)))
+        return;
+    if (drawing_id)
+    {
+        depth_buf(x, y) = v[2];
+        id_buf(x, y) = drawing_id;
+        ids_pending = true;
+        return;
+    }
+    // a deferred sample underneath has to be there to blend with
+    if (ids_pending && !id_buf.cleared(x, y) && id_buf(x, y))
+        shade_sample(x, y);
+
+    // only copied when the attributes have to be divided
+    vec divided;
+    if (perspective_enabled)
+    {
+        divided = v;
+        for (size_t i = 4; i < divided.size(); ++i)
+        {
+            divided[i] /= divided[3];
+        }
+    }
+
+    vec cs = shade_fragment(perspective_enabled ? divided : v, texture_enabled, srgb_enabled, decals_enabled, texture);
+    vec cd = {
         render_buf(x, y, 0),
         render_buf(x, y, 1),
         render_buf(x, y, 2),
         render_buf(x, y, 3)};
 
-    if (texture_enabled)
-    {
-        // TODO: round ?? there are some differences...
-        auto s = v[8], t = v[9];
-        int x = static_cast<int>(s * texture.width + 0.5) % texture.width;
-        int y = static_cast<int>(t * texture.height + 0.5) % texture.height;
+    vec c = alpha_blend(cs, cd);
+    render_buf.set_color(x, y, c[0], c[1], c[2], c[3]);
+    if (depth_enabled)
+        depth_buf(x, y) = v[2];
+}
 
-        cs = {
-            texture(x, y, 0) / 1.0,
-            texture(x, y, 1) / 1.0,
-            texture(x, y, 2) / 1.0,
-            texture(x, y, 3) / 255.0};
+// shades the primitive left at sample (x, y) of the resident buffers, with
+// attributes interpolated from barycentric coordinates of the sample
+void rasterizer::shade_sample(unsigned x, unsigned y)
+{
+    auto &id = id_buf(x, y);
+    auto &p = primitives[id - 1];
+    auto &state = states[p.state];
+    id = 0;
 
-        if (srgb_enabled)
-        {
-            cs[0] = srgb_to_linear(cs[0] / 255.0);
-            cs[1] = srgb_to_linear(cs[1] / 255.0);
-            cs[2] = srgb_to_linear(cs[2] / 255.0);
-        }
-        if (decals_enabled)
+    auto &a = p.v[0], &b = p.v[1], &c = p.v[2];
+    double px = x + origin_x, py = y + origin_y;
+    auto area = (b[0] - a[0]) * (c[1] - a[1]) - (c[0] - a[0]) * (b[1] - a[1]);
+    auto lb = ((px - a[0]) * (c[1] - a[1]) - (c[0] - a[0]) * (py - a[1])) / area;
+    auto lc = ((b[0] - a[0]) * (py - a[1]) - (px - a[0]) * (b[1] - a[1])) / area;
+    vec v = a + (b - a) * lb + (c - a) * lc;
+
+    if (state.perspective)
+    {
+        for (size_t i = 4; i < v.size(); ++i)
         {
-            cs = alpha_blend(cs, {v[4], v[5], v[6], v[7]});
+            v[i] /= v[3];
         }
     }
-    else
-    {
 
-        cs = {v[4], v[5], v[6], v[7]};
-    }
+    vec cs = shade_fragment(v, state.texture, state.srgb, state.decals, state.image);
+    vec cd = {
+        render_buf(x, y, 0),
+        render_buf(x, y, 1),
+        render_buf(x, y, 2),
+        render_buf(x, y, 3)};
 
-    vec c = alpha_blend(cs, cd);
-    if (depth_enabled)
+    vec col = alpha_blend(cs, cd);
+    render_buf.set_color(x, y, col[0], col[1], col[2], col[3]);
+}
+
+// second pass: every sample still holding an id is shaded exactly once,
+// however many deferred triangles were drawn over it
+void rasterizer::shade_deferred()
+{
+    if (!ids_pending)
+        return;
+    for (unsigned y = 0; y < id_buf.height; ++y)
+        for (unsigned x = 0; x < id_buf.width; ++x)
+            if (!id_buf.cleared(x, y) && id_buf(x, y))
+                shade_sample(x, y);
+    ids_pending = false;
+}
+
+void rasterizer::draw_triangle(tri triangle)
+{
+    for (auto &v : triangle)
+        v = project(v);
+    draw_projected(triangle);
+}
+
+void rasterizer::draw_projected(tri triangle)
+{
+    if (tile_size)
     {
-        if (v[2] >= -1.0 && v[2] < depth_buf(v[0], v[1]))
-        {
-            render_buf.set_color(x, y, c[0], c[1], c[2], c[3]);
-            depth_buf(x, y) = v[2];
-        }
+        record(TRIANGLE_PRIMITIVE, triangle, 0);
+    }
+    else if (deferrable(triangle))
+    {
+        primitives.push_back({TRIANGLE_PRIMITIVE, triangle, 0, current_state(), true, 0});
+        drawing_id = primitives.size();
+        scan_triangle(triangle);
+        drawing_id = 0;
     }
     else
     {
-        render_buf.set_color(x, y, c[0], c[1], c[2], c[3]);
+        scan_triangle(triangle);
     }
 }
 
-void rasterizer::draw_triangle(tri triangle)
+// a fragment can only skip blending with whatever ends up behind it if it
+// is opaque, which alpha_blend then reproduces exactly
+bool rasterizer::deferrable(const tri &v)
 {
-    for (auto &v : triangle)
-        v = project(v);
+    if (!deferred_enabled || !depth_enabled)
+        return false;
+    bool opaque = true;
+    for (auto &p : v)
+        opaque = opaque && (perspective_enabled ? p[7] / p[3] : p[7]) == 1.0;
+    if (texture_enabled)
+        return texture_opaque || (decals_enabled && opaque);
+    return opaque;
+}
 
+static void sort_rows(tri &triangle)
+{
     sort(triangle.begin(), triangle.end(), [](vec &a, vec &b)
          { return a[1] <= b[1]; });
+}
+
+void rasterizer::scan_triangle(tri triangle)
+{
+    sort_rows(triangle);
 
     std::vector<vec> bound1, bound2;
     dda_scan(triangle[0], triangle[2], 1, [&](vec &v)
@@ -344,16 +674,93 @@ void rasterizer::draw_triangle(tri triangle)
              { bound2.push_back(v); });
     dda_scan(triangle[1], triangle[2], 1, [&](vec &v)
              { bound2.push_back(v); });
-            
+
     assert(bound1.size() == bound2.size());
     auto n = bound1.size();
     for (size_t i = 0; i < n; ++i)
     {
-        dda_scan(bound1[i], bound2[i], 0, [&](vec v)
+        dda_scan(bound1[i], bound2[i], 0, [&](vec &v)
                  { draw_pixel(v); });
     }
 }
 
+// scans primitive i over the resident tile only; the samples are stepped
+// to exactly as by scan_triangle, which a jump straight into the tile
+// would not round to, so edges and spans carry on from earlier tiles
+void rasterizer::scan_tile_triangle(size_t i)
+{
+    auto &v = primitives[i].v;
+    double x0 = origin_x, y0 = origin_y;
+    double x1 = x0 + render_buf.width, y1 = y0 + render_buf.height;
+    if (std::min({v[0][0], v[1][0], v[2][0]}) >= x0 && std::max({v[0][0], v[1][0], v[2][0]}) < x1 &&
+        std::min({v[0][1], v[1][1], v[2][1]}) >= y0 && std::max({v[0][1], v[1][1], v[2][1]}) < y1)
+    {
+        // no other tile draws any of it
+        scan_triangle(v);
+        return;
+    }
+
+    auto &scan = scans[i];
+    if (scan.top != y0)
+    {
+        if (scan.bottom != y0)
+        {
+            // not carried on from the band above
+            tri t = v;
+            sort_rows(t);
+            scan.edges.clear();
+            scan.edges.emplace_back(t[0], t[2], 1);
+            scan.edges.emplace_back(t[0], t[1], 1);
+            scan.edges.emplace_back(t[1], t[2], 1);
+            scan.spans.clear();
+        }
+        // rows sit on whole y, but a sample may end up a hair above it and
+        // round into the row before, or from (-1, 0) into row 0; draw_pixel
+        // sorts out the samples of the rows kept for either reason
+        auto keep = std::find_if(scan.spans.begin(), scan.spans.end(), [&](const dda_walker &w)
+                                 { return w.p[1] >= y0 - 1.5; });
+        scan.spans.erase(scan.spans.begin(), keep);
+        auto &edge = scan.edges[0];
+        while (!edge.done() && edge.p[1] < y1 + 0.5)
+        {
+            auto &other = scan.edges[1].done() ? scan.edges[2] : scan.edges[1];
+            if (other.done())
+                break;
+            scan.spans.emplace_back(edge.p, other.p, 0);
+            edge.step();
+            other.step();
+        }
+        scan.top = y0;
+        scan.bottom = y1;
+        scan.left = -1;
+    }
+    if (x0 <= scan.left || scan.left < 0)
+        scan.cursors = scan.spans;
+    scan.left = x0;
+
+    for (auto &w : scan.cursors)
+    {
+        // x in (-1, 0) still rounds into the first column
+        if (x0 > 0)
+            while (!w.done() && w.p[0] < x0)
+                w.step();
+        for (; !w.done() && w.p[0] < x1; w.step())
+            draw_pixel(w.p);
+    }
+}
+
+// scans end with the band they were last carried to
+void rasterizer::forget_scans(double top)
+{
+    for (auto it = scans.begin(); it != scans.end();)
+    {
+        if (it->second.bottom < top)
+            it = scans.erase(it);
+        else
+            ++it;
+    }
+}
+
 vec intersect(const vec &p1, const vec &p2, const vec &plane)
 {
     auto d1 = plane * p1, d2 = plane * p2;
@@ -414,41 +821,214 @@ void rasterizer::draw_triangle_clipped(tri triangle)
     }
 }
 
-vec normal(const tri &triangle)
+size_t triangle_batch::size() const
+{
+    return slot[0].size();
+}
+
+unsigned triangle_batch::add_vertex(const std::vector<vec> &vertices, size_t i)
+{
+    if (slot_of.size() < vertices.size())
+        slot_of.resize(vertices.size());
+    if (slot_of[i])
+        return slot_of[i] - 1;
+
+    index.push_back(i);
+    slot_of[i] = index.size();
+    return index.size() - 1;
+}
+
+void triangle_batch::push(const std::vector<vec> &vertices, size_t i1, size_t i2, size_t i3)
+{
+    slot[0].push_back(add_vertex(vertices, i1));
+    slot[1].push_back(add_vertex(vertices, i2));
+    slot[2].push_back(add_vertex(vertices, i3));
+}
+
+void triangle_batch::clear()
 {
-    vec a = triangle[1] - triangle[0];
-    vec b = triangle[2] - triangle[1];
-    return {
-        a[1] * b[2] - a[2] * b[1],
-        a[2] * b[0] - a[0] * b[2],
-        a[0] * b[1] - a[1] * b[0]};
+    for (auto i : index)
+        slot_of[i] = 0;
+    index.clear();
+    x.clear();
+    y.clear();
+    z.clear();
+    w.clear();
+    projected.clear();
+    for (int k = 0; k < 3; ++k)
+        slot[k].clear();
+    draw.clear();
 }
 
 void rasterizer::draw_triangle(int i1, int i2, int i3)
 {
-    tri triangle = {nth_vertex(i1),
-                    nth_vertex(i2),
-                    nth_vertex(i3)};
+    // resolve relative indices now, later vertices would shift them
+    auto v1 = vertex_index(i1), v2 = vertex_index(i2), v3 = vertex_index(i3);
+    batch.push(vertices, v1, v2, v3);
+    if (tile_size)
+    {
+        record_draw(TRIANGLE_PRIMITIVE, v1, v2, v3);
+        batch.draw.push_back(draws.size() - 1);
+    }
+    if (batch.size() == TRIANGLE_BATCH_SIZE)
+        flush_triangles();
+}
+
+void rasterizer::draw_triangles(const std::vector<int> &indices)
+{
+    expand_triangles(TRIANGLE_LIST, indices, [this](int i1, int i2, int i3)
+                     { draw_triangle(i1, i2, i3); });
+}
+
+void rasterizer::draw_triangle_strip(const std::vector<int> &indices)
+{
+    expand_triangles(TRIANGLE_STRIP, indices, [this](int i1, int i2, int i3)
+                     { draw_triangle(i1, i2, i3); });
+}
+
+void rasterizer::draw_triangle_fan(const std::vector<int> &indices)
+{
+    expand_triangles(TRIANGLE_FAN, indices, [this](int i1, int i2, int i3)
+                     { draw_triangle(i1, i2, i3); });
+}
 
-    // facing down (+z direction)
-    if (cull_enabled && normal(triangle)[2] >= 0)
+void rasterizer::flush_triangles()
+{
+    auto n = batch.size();
+    if (!n)
         return;
 
-    // TODO: always?
-    if (frustum_clipping_enabled || true)
+    const double sw = width * fsaa_level, sh = height * fsaa_level;
+    const bool cull = cull_enabled;
+
+    // per vertex: clip-space position from the vertex stage, screen
+    // position and whether clipping can leave it alone
+    auto m = batch.index.size();
+    batch.x.resize(m);
+    batch.y.resize(m);
+    batch.z.resize(m);
+    batch.w.resize(m);
+    if (identity)
     {
-        draw_triangle_clipped(triangle);
+        for (size_t i = 0; i < m; ++i)
+        {
+            auto &v = vertices[batch.index[i]];
+            batch.x[i] = v[0];
+            batch.y[i] = v[1];
+            batch.z[i] = v[2];
+            batch.w[i] = v[3];
+        }
     }
     else
     {
-        draw_triangle(triangle);
+        clip_space.update(vertices, matrices.back());
+        for (size_t i = 0; i < m; ++i)
+        {
+            auto k = batch.index[i];
+            batch.x[i] = clip_space.x[k];
+            batch.y[i] = clip_space.y[k];
+            batch.z[i] = clip_space.z[k];
+            batch.w[i] = clip_space.w[k];
+        }
+    }
+    batch.sx.resize(m);
+    batch.sy.resize(m);
+    batch.inside.assign(m, 1);
+    batch.projected.resize(m);
+    const double *x = batch.x.data(), *y = batch.y.data(), *z = batch.z.data(), *w = batch.w.data();
+    double *sx = batch.sx.data(), *sy = batch.sy.data();
+    unsigned char *inside = batch.inside.data();
+    for (size_t i = 0; i < m; ++i)
+    {
+        sx[i] = (x[i] / w[i] + 1) * sw / 2;
+        sy[i] = (y[i] / w[i] + 1) * sh / 2;
+    }
+    for (auto &plane : clip_planes)
+    {
+        // summed in the same order as the dot product in the clipper
+        const double p0 = plane[0], p1 = plane[1], p2 = plane[2], p3 = plane[3];
+        for (size_t i = 0; i < m; ++i)
+            inside[i] &= p3 * w[i] + p2 * z[i] + p1 * y[i] + p0 * x[i] >= 0;
+    }
+
+    const unsigned *s0 = batch.slot[0].data(), *s1 = batch.slot[1].data(), *s2 = batch.slot[2].data();
+    batch.keep.resize(n);
+    unsigned char *keep = batch.keep.data();
+
+    // branch-free setup over the whole batch so that it vectorizes
+    for (size_t i = 0; i < n; ++i)
+    {
+        auto a = s0[i], b = s1[i], c = s2[i];
+
+        // triangles reaching behind the eye are left to the clipper
+        bool front = w[a] > 0 && w[b] > 0 && w[c] > 0;
+
+        auto ax = sx[a], ay = sy[a];
+        auto bx = sx[b], by = sy[b];
+        auto cx = sx[c], cy = sy[c];
+        auto area = (bx - ax) * (cy - ay) - (cx - ax) * (by - ay);
+
+        // facing down (+z direction), tested on the clip-space x and y as
+        // always, whatever the sign of w
+        auto normal = (x[b] - x[a]) * (y[c] - y[b]) - (y[b] - y[a]) * (x[c] - x[b]);
+
+        // samples sit on integer coordinates and spans are half-open,
+        // so a triangle is hit only if [ceil(min), max) holds an integer
+        auto min_x = std::max(std::ceil(std::min(std::min(ax, bx), cx)), 0.0);
+        auto min_y = std::max(std::ceil(std::min(std::min(ay, by), cy)), 0.0);
+        auto max_x = std::min(std::max(std::max(ax, bx), cx), sw);
+        auto max_y = std::min(std::max(std::max(ay, by), cy), sh);
+        bool covers = area != 0 && min_x < max_x && min_y < max_y;
+
+        keep[i] = (!cull || normal < 0) && (!front || covers);
     }
+
+    for (size_t i = 0; i < n; ++i)
+    {
+        if (!keep[i])
+            continue;
+        if (tile_size)
+            current_draw = batch.draw[i];
+        unsigned slots[] = {s0[i], s1[i], s2[i]};
+        if (!inside[slots[0]] || !inside[slots[1]] || !inside[slots[2]])
+        {
+            // TODO: always?
+            draw_triangle_clipped({clip_vertex(batch.index[slots[0]]),
+                                   clip_vertex(batch.index[slots[1]]),
+                                   clip_vertex(batch.index[slots[2]])});
+            continue;
+        }
+        // the clipper would pass it through unchanged, so reuse the
+        // projection of vertices shared with earlier triangles
+        tri triangle;
+        for (int k = 0; k < 3; ++k)
+        {
+            auto &p = batch.projected[slots[k]];
+            if (p.empty())
+                p = project(clip_vertex(batch.index[slots[k]]));
+            triangle[k] = p;
+        }
+        draw_projected(triangle);
+    }
+    batch.clear();
 }
 
 void rasterizer::draw_point(int i, double size)
 {
-    auto w = size / 2;
+    flush_triangles();
     vec o = project(nth_vertex(i));
+    if (tile_size)
+    {
+        record_draw(POINT_PRIMITIVE, vertex_index(i), 0, 0, size);
+        record(POINT_PRIMITIVE, {o}, size);
+    }
+    else
+        scan_point(o, size);
+}
+
+void rasterizer::scan_point(const vec &o, double size)
+{
+    auto w = size / 2;
     vec v1 = {o[0] - w, o[1] - w, o[2], o[3], o[4], o[5], o[6], o[7], 0, 0};
     vec v2 = {o[0] - w, o[1] + w, o[2], o[3], o[4], o[5], o[6], o[7], 0, 1};
     // this might cause points to be off-screen
@@ -459,8 +1039,20 @@ void rasterizer::draw_point(int i, double size)
 
 void rasterizer::draw_line(int i1, int i2)
 {
+    flush_triangles();
     // TODO: what about color
     auto v1 = project(nth_vertex(i1)), v2 = project(nth_vertex(i2));
+    if (tile_size)
+    {
+        record_draw(LINE_PRIMITIVE, vertex_index(i1), vertex_index(i2));
+        record(LINE_PRIMITIVE, {v1, v2}, 0);
+    }
+    else
+        scan_line(v1, v2);
+}
+
+void rasterizer::scan_line(const vec &v1, const vec &v2)
+{
     auto d0 = std::abs(v1[0] - v2[0]), d1 = std::abs(v1[1] - v2[1]);
     int i = d0 > d1 ? 0 : 1, j = i ^ 1;
     dda_scan(v1, v2, i, [&](vec p)
@@ -470,9 +1062,21 @@ void rasterizer::draw_line(int i1, int i2)
 
 void rasterizer::draw_wuline(int i1, int i2)
 {
+    flush_triangles();
     // TODO: only rgb??
     // TODO: what about color
     auto v1 = project(nth_vertex(i1)), v2 = project(nth_vertex(i2));
+    if (tile_size)
+    {
+        record_draw(WULINE_PRIMITIVE, vertex_index(i1), vertex_index(i2));
+        record(WULINE_PRIMITIVE, {v1, v2}, 0);
+    }
+    else
+        scan_wuline(v1, v2);
+}
+
+void rasterizer::scan_wuline(const vec &v1, const vec &v2)
+{
     auto d0 = std::abs(v1[0] - v2[0]), d1 = std::abs(v1[1] - v2[1]);
     int i = d0 > d1 ? 0 : 1, j = i ^ 1;
     dda_scan(v1, v2, i, [&](vec p)
@@ -487,13 +1091,358 @@ void rasterizer::draw_wuline(int i1, int i2)
                  draw_pixel(p); });
 }
 
+size_t rasterizer::current_state()
+{
+    if (states.empty() || states.back().depth != depth_enabled || states.back().srgb != srgb_enabled ||
+        states.back().perspective != perspective_enabled || states.back().texture != texture_enabled ||
+        states.back().decals != decals_enabled || states.back().image != texture)
+    {
+        states.push_back({depth_enabled, srgb_enabled, perspective_enabled,
+                          texture_enabled, decals_enabled, texture});
+    }
+    return states.size() - 1;
+}
+
+void rasterizer::record(primitive_kind kind, const tri &v, double size)
+{
+    bool deferred = kind == TRIANGLE_PRIMITIVE && deferrable(v);
+    // the state of the draw, so that redraws do not add copies of it
+    primitives.push_back({kind, v, size, draws[current_draw].state, deferred, current_draw});
+
+    // sample-space bounds, padded for rounding and the second wuline pixel
+    double min_x = HUGE_VAL, min_y = HUGE_VAL, max_x = -HUGE_VAL, max_y = -HUGE_VAL;
+    for (auto &p : v)
+    {
+        if (p.empty())
+            continue;
+        min_x = std::min(min_x, p[0] - size / 2 - 1);
+        min_y = std::min(min_y, p[1] - size / 2 - 1);
+        max_x = std::max(max_x, p[0] + size / 2 + 1);
+        max_y = std::max(max_y, p[1] + size / 2 + 1);
+    }
+    double span = tile_size * fsaa_level;
+    int tx0 = std::max(0.0, std::floor(min_x / span));
+    int ty0 = std::max(0.0, std::floor(min_y / span));
+    int tx1 = std::min<double>(tiles_x - 1, std::floor(max_x / span));
+    int ty1 = std::min<double>(tiles_y - 1, std::floor(max_y / span));
+    for (int ty = ty0; ty <= ty1; ++ty)
+        for (int tx = tx0; tx <= tx1; ++tx)
+        {
+            bins[ty * tiles_x + tx].push_back(primitives.size() - 1);
+            dirty[ty * tiles_x + tx] = 1;
+        }
+}
+
+void rasterizer::set_state(const pixel_state &state)
+{
+    depth_enabled = state.depth;
+    srgb_enabled = state.srgb;
+    perspective_enabled = state.perspective;
+    texture_enabled = state.texture;
+    decals_enabled = state.decals;
+    texture = state.image;
+}
+
+void rasterizer::replay(size_t i)
+{
+    auto &p = primitives[i];
+    set_state(states[p.state]);
+
+    switch (p.kind)
+    {
+    case TRIANGLE_PRIMITIVE:
+        drawing_id = p.deferred ? i + 1 : 0;
+        scan_tile_triangle(i);
+        drawing_id = 0;
+        break;
+    case POINT_PRIMITIVE:
+        scan_point(p.v[0], p.size);
+        break;
+    case LINE_PRIMITIVE:
+        scan_line(p.v[0], p.v[1]);
+        break;
+    case WULINE_PRIMITIVE:
+        scan_wuline(p.v[0], p.v[1]);
+        break;
+    }
+}
+
+void rasterizer::record_draw(primitive_kind kind, size_t i1, size_t i2, size_t i3, double size)
+{
+    draws.push_back({kind, {i1, i2, i3}, size, current_state(), clip_planes.size(), current_matrix(),
+                     cull_enabled, deferred_enabled, texture_opaque, false});
+    current_draw = draws.size() - 1;
+}
+
+size_t rasterizer::current_matrix()
+{
+    if (draw_matrices.empty() || draw_matrices.back() != matrices.back())
+        draw_matrices.push_back(matrices.back());
+    return draw_matrices.size() - 1;
+}
+
+size_t rasterizer::draw_count() const
+{
+    return draws.size();
+}
+
+// makes draw d again through the whole pipeline, with the state it was
+// first made with; planes are all the clip planes there are. Triangles
+// are batched for as long as the state stays the same
+void rasterizer::redraw(size_t d, const std::vector<vec> &planes)
+{
+    auto &call = draws[d];
+    auto &state = states[call.state];
+    if (state.depth != depth_enabled || state.srgb != srgb_enabled || state.perspective != perspective_enabled ||
+        state.texture != texture_enabled || state.decals != decals_enabled || state.image != texture ||
+        call.cull != cull_enabled || call.deferred != deferred_enabled || call.opaque != texture_opaque ||
+        call.planes != clip_planes.size())
+    {
+        flush_triangles();
+        set_state(state);
+        cull_enabled = call.cull;
+        deferred_enabled = call.deferred;
+        texture_opaque = call.opaque;
+        clip_planes.assign(planes.begin(), planes.begin() + call.planes);
+    }
+    // set_matrix flushes the batch itself, if the matrix changes
+    set_matrix(draw_matrices[call.matrix]);
+    current_draw = d;
+
+    auto &v = call.v;
+    switch (call.kind)
+    {
+    case TRIANGLE_PRIMITIVE:
+        batch.push(vertices, v[0], v[1], v[2]);
+        batch.draw.push_back(d);
+        if (batch.size() == TRIANGLE_BATCH_SIZE)
+            flush_triangles();
+        break;
+    case POINT_PRIMITIVE:
+        record(POINT_PRIMITIVE, {project(clip_vertex(v[0]))}, call.size);
+        break;
+    case LINE_PRIMITIVE:
+    case WULINE_PRIMITIVE:
+        record(call.kind, {project(clip_vertex(v[0])), project(clip_vertex(v[1]))}, 0);
+        break;
+    }
+}
+
+void rasterizer::update(const primitive_diff &diff)
+{
+    if (!tile_size)
+    {
+        throw std::runtime_error("updates need tiling");
+    }
+    // nothing changes unless the whole diff is valid
+    std::vector<size_t> indices;
+    for (auto &v : diff.vertices)
+    {
+        indices.push_back(vertex_index(v.first));
+        if (v.second.size() != 10)
+        {
+            throw std::invalid_argument("a vertex needs x y z w r g b a s t");
+        }
+    }
+    for (auto d : diff.removed)
+    {
+        if (d >= draws.size())
+        {
+            throw std::out_of_range("draw index out of range");
+        }
+    }
+    flush_triangles();
+
+    std::vector<unsigned char> changed(vertices.size()), affected(draws.size());
+    for (size_t k = 0; k < indices.size(); ++k)
+    {
+        auto i = indices[k];
+        vertices[i] = diff.vertices[k].second;
+        changed[i] = 1;
+        clip_space.count = std::min(clip_space.count, i);
+    }
+    for (auto d : diff.removed)
+    {
+        draws[d].removed = true;
+        affected[d] = 1;
+    }
+    for (size_t d = 0; d < draws.size(); ++d)
+    {
+        auto &call = draws[d];
+        unsigned n = call.kind == TRIANGLE_PRIMITIVE ? 3 : call.kind == POINT_PRIMITIVE ? 1 : 2;
+        for (unsigned k = 0; k < n; ++k)
+            affected[d] |= changed[call.v[k]];
+    }
+
+    // the primitives of affected draws go, and so do their tiles; the rest
+    // move down over the gaps
+    std::vector<size_t> moved(primitives.size());
+    std::vector<unsigned char> gone(primitives.size());
+    size_t kept = 0;
+    for (size_t i = 0; i < primitives.size(); ++i)
+    {
+        gone[i] = affected[primitives[i].draw];
+        if (gone[i])
+            continue;
+        moved[i] = kept;
+        if (kept != i)
+            primitives[kept] = std::move(primitives[i]);
+        ++kept;
+    }
+    primitives.resize(kept);
+    for (size_t t = 0; t < bins.size(); ++t)
+    {
+        auto &bin = bins[t];
+        size_t n = 0;
+        for (auto i : bin)
+            if (!gone[i])
+                bin[n++] = moved[i];
+        if (n != bin.size())
+        {
+            bin.resize(n);
+            dirty[t] = 1;
+        }
+    }
+
+    pixel_state current{depth_enabled, srgb_enabled, perspective_enabled,
+                        texture_enabled, decals_enabled, texture};
+    bool cull = cull_enabled, deferred = deferred_enabled, opaque = texture_opaque;
+    auto planes = clip_planes;
+    auto matrix = matrices.back();
+    auto first = primitives.size();
+    for (size_t d = 0; d < draws.size(); ++d)
+        if (affected[d] && !draws[d].removed)
+            redraw(d, planes);
+    flush_triangles();
+    set_state(current);
+    cull_enabled = cull;
+    deferred_enabled = deferred;
+    texture_opaque = opaque;
+    clip_planes = planes;
+    set_matrix(matrix);
+
+    // new primitives went to the ends of their bins, but are replayed in
+    // the order of the draws they belong to
+    for (auto &bin : bins)
+    {
+        if (bin.size() && bin.back() >= first)
+            std::stable_sort(bin.begin(), bin.end(), [&](size_t a, size_t b)
+                             { return primitives[a].draw < primitives[b].draw; });
+    }
+}
+
+void rasterizer::render_tile(unsigned tx, unsigned ty)
+{
+    origin_x = tx * tile_size * fsaa_level;
+    origin_y = ty * tile_size * fsaa_level;
+    render_buf.clear();
+    depth_buf.clear();
+    id_buf.clear();
+    ids_pending = false;
+    auto &bin = bins[ty * tiles_x + tx];
+    if (bin.empty())
+        return;
+    for (auto i : bin)
+        replay(i);
+    shade_deferred();
+}
+
+void rasterizer::render_bands(const std::function<void(unsigned y, frame_buffer<unsigned char> &band)> &emit)
+{
+    flush_triangles();
+    pixel_state current{depth_enabled, srgb_enabled, perspective_enabled,
+                        texture_enabled, decals_enabled, texture};
+
+    frame_buffer<unsigned char> band;
+    scans.clear();
+    for (unsigned ty = 0; ty < tiles_y; ++ty)
+    {
+        unsigned y = ty * tile_size;
+        forget_scans(y * fsaa_level);
+        band.resize(width, std::min<unsigned>(tile_size, height - y));
+        for (unsigned tx = 0; tx < tiles_x; ++tx)
+        {
+            unsigned x = tx * tile_size;
+            render_tile(tx, ty);
+            // srgb is resolved with the final setting, as without tiles
+            srgb_enabled = current.srgb;
+            resolve(band, x, 0, std::min<unsigned>(tile_size, width - x), band.height);
+        }
+        emit(y, band);
+    }
+    scans.clear();
+    set_state(current);
+}
+
 void rasterizer::output()
 {
-    int out_height = output_buf.height, out_width = output_buf.width;
-    for (int x = 0; x < out_width; ++x)
+    flush_triangles();
+    if (!tile_size)
+    {
+        // deferred triangles are only needed until their samples are shaded
+        shade_deferred();
+        primitives.clear();
+        states.clear();
+        resolve(output_buf, 0, 0, width, height);
+        return;
+    }
+
+    // the assembled image is kept, so only tiles drawn over since are redone
+    if (output_buf.width != static_cast<unsigned>(width) || output_buf.height != static_cast<unsigned>(height))
     {
+        output_buf.resize(width, height);
+        dirty.assign(dirty.size(), 1);
+    }
+    pixel_state current{depth_enabled, srgb_enabled, perspective_enabled,
+                        texture_enabled, decals_enabled, texture};
+    scans.clear();
+    for (unsigned ty = 0; ty < tiles_y; ++ty)
+    {
+        forget_scans(ty * tile_size * fsaa_level);
+        for (unsigned tx = 0; tx < tiles_x; ++tx)
+        {
+            if (!dirty[ty * tiles_x + tx])
+                continue;
+            unsigned x = tx * tile_size, y = ty * tile_size;
+            render_tile(tx, ty);
+            srgb_enabled = current.srgb;
+            resolve(output_buf, x, y, std::min<unsigned>(tile_size, width - x), std::min<unsigned>(tile_size, height - y));
+            dirty[ty * tiles_x + tx] = 0;
+        }
+    }
+    scans.clear();
+    set_state(current);
+}
+
+// averages the samples of a w x h block of pixels at the top left of
+// render_buf into dst at (dx, dy)
+void rasterizer::resolve(frame_buffer<unsigned char> &dst, unsigned dx, unsigned dy, unsigned w, unsigned h)
+{
+    // e.g. a scene without a "png" line
+    if (w == 0 || h == 0)
+        return;
+    // read only, so that untouched blocks stay untouched
+    const frame_buffer<double> &samples = render_buf;
+    int out_height = h, out_width = w;
+    // nothing was drawn, and dst only needs clearing if it is not already
+    if (samples.cleared(0, 0, fsaa_level * w, fsaa_level * h))
+    {
+        if (dst.cleared(dx, dy, w, h))
+            return;
         for (int y = 0; y < out_height; ++y)
+            for (int x = 0; x < out_width; ++x)
+                dst.set_color(dx + x, dy + y, 0, 0, 0, 0);
+        return;
+    }
+    for (int y = 0; y < out_height; ++y)
+    {
+        for (int x = 0; x < out_width; ++x)
         {
+            if (samples.cleared(fsaa_level * x, fsaa_level * y, fsaa_level, fsaa_level))
+            {
+                dst.set_color(dx + x, dy + y, 0, 0, 0, 0);
+                continue;
+            }
             double r = 0.0, g = 0.0, b = 0.0, a = 0.0;
             for (int i = 0; i < fsaa_level; ++i)
             {
@@ -501,10 +1450,10 @@ void rasterizer::output()
                 {
                     auto src_x = fsaa_level * x + j;
                     auto src_y = fsaa_level * y + i;
-                    auto alpha = render_buf(src_x, src_y, 3);
-                    r += alpha * render_buf(src_x, src_y, 0);
-                    g += alpha * render_buf(src_x, src_y, 1);
-                    b += alpha * render_buf(src_x, src_y, 2);
+                    auto alpha = samples(src_x, src_y, 3);
+                    r += alpha * samples(src_x, src_y, 0);
+                    g += alpha * samples(src_x, src_y, 1);
+                    b += alpha * samples(src_x, src_y, 2);
                     a += alpha;
                 }
             }
@@ -522,7 +1471,7 @@ void rasterizer::output()
                 b = linear_to_srgb(b) * 255.0;
             }
             a *= 255.0;
-            output_buf.set_color(x, y, r, g, b, a);
+            dst.set_color(dx + x, dy + y, r, g, b, a);
         }
     }
 }
@@ -1,6 +1,8 @@
+#pragma once
 #include <iostream>
 #include <vector>
 #include <array>
+#include <functional>
 #include <map>
 #include <queue>
 #include <vector>
@@ -10,27 +12,174 @@
 #include <cassert>
 #include <stdexcept>
 #include "buffer.hpp"
+#include "texture_cache.hpp"
 
 using vec = std::vector<double>;
 using mat = std::vector<std::vector<double>>;
 using tri = std::array<vec, 3>;
+using matrix4 = std::array<double, 16>; // row-major
 
 #define TEXTURE_SIZE 512
+#define TRIANGLE_BATCH_SIZE 256
+#define TILE_SIZE 256
+#define VERTEX_BATCH_SIZE 256
+
+enum triangle_topology
+{
+    TRIANGLE_LIST,  // independent index triples
+    TRIANGLE_STRIP, // each index after the first two adds a triangle
+    TRIANGLE_FAN,   // triangles around the first index
+};
+
+// calls draw(i1, i2, i3) for every triangle the indices describe; every
+// other strip triangle is flipped to keep the winding of the first
+template <class Draw>
+void expand_triangles(triangle_topology topology, const std::vector<int> &indices, Draw draw)
+{
+    switch (topology)
+    {
+    case TRIANGLE_LIST:
+        for (size_t k = 0; k + 2 < indices.size(); k += 3)
+            draw(indices[k], indices[k + 1], indices[k + 2]);
+        break;
+    case TRIANGLE_STRIP:
+        for (size_t k = 0; k + 2 < indices.size(); ++k)
+        {
+            if (k % 2)
+                draw(indices[k + 1], indices[k], indices[k + 2]);
+            else
+                draw(indices[k], indices[k + 1], indices[k + 2]);
+        }
+        break;
+    case TRIANGLE_FAN:
+        for (size_t k = 1; k + 1 < indices.size(); ++k)
+            draw(indices[0], indices[k], indices[k + 1]);
+        break;
+    }
+}
+
+// pending triangles in structure-of-arrays form; vertices shared by
+// neighbouring triangles are stored, projected and clip-tested only once
+struct triangle_batch
+{
+    std::vector<size_t> index;          // into rasterizer::vertices
+    std::vector<double> x, y, z, w;     // clip space
+    std::vector<double> sx, sy;         // screen space
+    std::vector<unsigned char> inside;  // inside every clip plane
+    std::vector<vec> projected;         // filled on demand
+    std::vector<unsigned> slot[3];      // per triangle, into the arrays above
+    std::vector<unsigned char> keep;
+    std::vector<unsigned> slot_of;      // vertex index -> slot + 1, 0 if absent
+    std::vector<size_t> draw;           // per triangle, only with tiles
+    size_t size() const;
+    void push(const std::vector<vec> &vertices, size_t i1, size_t i2, size_t i3);
+    unsigned add_vertex(const std::vector<vec> &vertices, size_t i);
+    void clear();
+};
+
+// clip-space positions of rasterizer::vertices in structure-of-arrays form,
+// valid for the first count vertices under matrix
+struct transformed_vertices
+{
+    std::vector<double> x, y, z, w;
+    matrix4 matrix = {{1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1}};
+    size_t count = 0;
+    void update(const std::vector<vec> &vertices, const matrix4 &m);
+};
+
+// a dda_scan in progress along axis i: p is the next sample, and the scan
+// is over once p reaches end
+struct dda_walker
+{
+    vec p, s;
+    double end;
+    int axis;
+    dda_walker(vec a, vec b, int i);
+    bool done() const;
+    void step();
+};
+
+// how far a triangle drawn over several tiles has been scanned, so that
+// every tile carries on where the one to its left and the band above left
+// off, stepping to exactly the samples it would reach without tiles
+struct triangle_scan
+{
+    std::vector<dda_walker> edges; // the long edge, then the two short ones
+    std::vector<dda_walker> spans;   // rows near the band, from their start
+    std::vector<dda_walker> cursors; // the same rows, at the next tile
+    double top = -1, bottom = -1, left = -1; // band and last tile, in samples
+};
+
+// everything draw_pixel depends on, kept for primitives replayed per tile
+struct pixel_state
+{
+    bool depth, srgb, perspective, texture, decals;
+    texture_ptr image;
+};
+
+enum primitive_kind
+{
+    TRIANGLE_PRIMITIVE,
+    POINT_PRIMITIVE,
+    LINE_PRIMITIVE,
+    WULINE_PRIMITIVE
+};
+
+// a projected primitive waiting in the tile bins or, when deferred, for
+// the visible samples it covers to be shaded
+struct primitive
+{
+    primitive_kind kind;
+    tri v; // unused slots are left empty
+    double size;
+    size_t state;
+    bool deferred;
+    size_t draw; // the draw call it came from, only with tiles
+};
+
+// a draw call as made, with everything needed to make it again after
+// its vertices have changed
+struct draw_call
+{
+    primitive_kind kind;
+    size_t v[3]; // into rasterizer::vertices
+    double size;
+    size_t state;
+    size_t planes; // clip planes in use
+    size_t matrix; // into rasterizer::draw_matrices
+    bool cull, deferred, opaque, removed;
+};
+
+// changes to a tiled scene that has already been drawn; draws are numbered
+// in the order they were made, one per triangle, since the scene last
+// started over: resize, enable_fsaa and enable_tiling all drop every draw
+struct primitive_diff
+{
+    std::vector<std::pair<int, vec>> vertices; // index, x y z w r g b a s t
+    std::vector<size_t> removed;               // draw numbers
+};
 
 class rasterizer
 {
 public:
     rasterizer();
+    explicit rasterizer(texture_cache &textures);
     int width = 0, height = 0;
     void resize(int w, int h);
     void add_vec(double x, double y, double z, double w);
     void set_color(double r, double g, double b, double a);
     void set_texcoord(double s, double t);
     void output();
-    std::vector<unsigned char> &data();
-    void draw_pixel(vec pixel);
+    buffer_storage<unsigned char> &data();
+    void save(std::string &filename, int level = PNG_LEVEL_DEFAULT, unsigned threads = 0);
+    void draw_pixel(const vec &pixel);
     void draw_point(int i, double size);
     void draw_triangle(int i1, int i2, int i3);
+    // one draw for many triangles, given as index triples, as a strip or
+    // as a fan; negative indices count back from the last vertex
+    void draw_triangles(const std::vector<int> &indices);
+    void draw_triangle_strip(const std::vector<int> &indices);
+    void draw_triangle_fan(const std::vector<int> &indices);
     void draw_line(int i1, int i2);
     void draw_wuline(int i1, int i2);
     void enable_depth();
@@ -40,10 +189,28 @@ public:
     void enable_fsaa(int level);
     void cull_face();
     void load_texture(std::string &filename);
+    // uses an already decoded texture, e.g. one kept by a command list
+    void bind_texture(texture_ptr image);
     void enable_texture();
     void disable_texture();
     void enable_decals();
+    // depth-tested opaque triangles only leave depth and their id in the
+    // visibility buffer; the samples still visible are shaded once later
+    void enable_deferred();
     void clip(double p1, double p2, double p3, double p4);
+    // positions are multiplied by the matrix current when they are drawn,
+    // as columns (x, y, z, w); multiplying applies m before the matrix
+    void load_matrix(const matrix4 &m);
+    void multiply_matrix(const matrix4 &m);
+    void push_matrix();
+    void pop_matrix();
+    // renders in tiles of size x size pixels, 0 to turn off; only one
+    // tile of samples is resident and save() streams finished bands
+    void enable_tiling(int size = TILE_SIZE);
+    // with tiles, changes vertices or takes draws out again; the next
+    // output() renders only the tiles that these or any new draws touch
+    void update(const primitive_diff &diff);
+    size_t draw_count() const;
 
 private:
     double r, g, b, a, s, t;
@@ -55,14 +222,60 @@ private:
     bool cull_enabled;
     bool texture_enabled;
     bool decals_enabled;
-    frame_buffer<unsigned char> texture;
+    bool deferred_enabled;
+    bool texture_opaque;
+    texture_cache &textures;
+    texture_ptr texture;
     frame_buffer<unsigned char> output_buf;
     frame_buffer<double> render_buf;
-    depth_buffer depth_buf;
+    sample_buffer<double> depth_buf;
+    sample_buffer<unsigned> id_buf; // primitive index + 1
+    unsigned drawing_id;            // written instead of shading, 0 if none
+    bool ids_pending;
     std::vector<vec> vertices;
     std::vector<vec> clip_planes;
-    vec &nth_vertex(int i);
+    std::vector<matrix4> matrices; // the stack, current one last
+    bool identity;                 // the current matrix changes nothing
+    transformed_vertices clip_space;
+    triangle_batch batch;
+    int tile_size;
+    unsigned tiles_x, tiles_y;
+    unsigned origin_x, origin_y; // sample offset of the resident tile
+    std::vector<pixel_state> states;
+    std::vector<primitive> primitives;
+    std::vector<std::vector<size_t>> bins;
+    std::vector<unsigned char> dirty; // per tile, still to render for output()
+    std::map<size_t, triangle_scan> scans; // by primitive, during one pass
+    std::vector<draw_call> draws;
+    std::vector<matrix4> draw_matrices;
+    size_t current_draw;
+    size_t vertex_index(int i);
+    vec nth_vertex(int i);
+    vec clip_vertex(size_t i);
+    void set_matrix(const matrix4 &m);
+    size_t current_matrix();
     vec project(vec p);
     void draw_triangle_clipped(tri triangle);
     void draw_triangle(tri triangle);
+    void draw_projected(tri triangle);
+    void flush_triangles();
+    void allocate_buffers();
+    size_t current_state();
+    bool deferrable(const tri &v);
+    void record(primitive_kind kind, const tri &v, double size);
+    void replay(size_t i);
+    void record_draw(primitive_kind kind, size_t i1, size_t i2 = 0, size_t i3 = 0, double size = 0);
+    void redraw(size_t d, const std::vector<vec> &planes);
+    void set_state(const pixel_state &state);
+    void shade_sample(unsigned x, unsigned y);
+    void shade_deferred();
+    void scan_triangle(tri triangle);
+    void scan_tile_triangle(size_t i);
+    void forget_scans(double top);
+    void scan_point(const vec &o, double size);
+    void scan_line(const vec &v1, const vec &v2);
+    void scan_wuline(const vec &v1, const vec &v2);
+    void render_tile(unsigned tx, unsigned ty);
+    void render_bands(const std::function<void(unsigned y, frame_buffer<unsigned char> &band)> &emit);
+    void resolve(frame_buffer<unsigned char> &dst, unsigned dx, unsigned dy, unsigned w, unsigned h);
 };
@@ -0,0 +1,151 @@
+#include <algorithm>
+#include <fstream>
+#include <memory>
+#include <stdexcept>
+#include "render_service.hpp"
+#include "scene.hpp"
+
+render_service::render_service(unsigned threads, texture_cache &textures)
+    : textures(textures), stopping{false}
+{
+    threads = std::max(threads, 1u);
+    for (unsigned i = 0; i < threads; ++i)
+        workers.emplace_back(&render_service::work, this);
+}
+
+render_service::~render_service()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    ready.notify_all();
+    for (auto &worker : workers)
+        worker.join();
+}
+
+// the file name job will write in its output directory
+std::string render_service::claim_output(const render_job &job)
+{
+    std::ifstream file(job.path);
+    if (!file)
+        throw std::runtime_error("cannot open " + job.path);
+    auto name = scene_output_name(file);
+    if (name.empty())
+        throw std::invalid_argument("no png command names the output file");
+    if (name.find_first_of("/\\") != std::string::npos || name == "." || name == "..")
+        throw std::invalid_argument("png: " + name + " is not a plain file name");
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!outputs.insert(job.output + "/" + name).second)
+        throw std::invalid_argument("png: " + name + " is written by another scene as well");
+    return name;
+}
+
+std::future<render_result> render_service::submit(const render_job &job)
+{
+    std::string name;
+    if (job.output.size())
+    {
+        try
+        {
+            name = claim_output(job);
+        }
+        catch (...)
+        {
+            std::promise<render_result> failed;
+            failed.set_exception(std::current_exception());
+            return failed.get_future();
+        }
+    }
+
+    auto &cache = textures;
+    auto task = std::make_shared<std::packaged_task<render_result()>>([job, name, &cache]()
+    {
+        std::ifstream file(job.path);
+        if (!file)
+            throw std::runtime_error("cannot open " + job.path);
+
+        scene_options options;
+        options.pipelined = job.pipelined;
+        auto slash = job.path.find_last_of('/');
+        if (slash != std::string::npos)
+            options.directory = job.path.substr(0, slash + 1);
+
+        rasterizer raster(cache);
+        if (job.tile_size)
+            raster.enable_tiling(job.tile_size);
+        render_result result;
+        if (job.replays > 0)
+        {
+            command_list list(cache);
+            result.filename = record_scene(list, file, options);
+            // the last replay is the one whose image is kept
+            for (int i = 1; i < job.replays; ++i)
+            {
+                rasterizer scratch(cache);
+                if (job.tile_size)
+                    scratch.enable_tiling(job.tile_size);
+                list.replay(scratch);
+                scratch.output();
+            }
+            list.replay(raster);
+        }
+        else
+            result.filename = render_scene(raster, file, options);
+        if (job.update.size())
+        {
+            std::ifstream diff(job.update);
+            if (!diff)
+                throw std::runtime_error("cannot open " + job.update);
+            // the first frame, of which the diff only redraws what changed
+            raster.output();
+            raster.update(read_diff(diff));
+        }
+        result.draws = raster.draw_count();
+        result.width = raster.width;
+        result.height = raster.height;
+        if (job.output.size())
+        {
+            // the scene may have been edited since its name was claimed
+            if (result.filename != name)
+                throw std::runtime_error("png: " + result.filename + " changed from " + name + " while rendering");
+            // jobs already run in parallel, so encode on this thread only
+            auto path = job.output + "/" + name;
+            raster.save(path, job.level, 1);
+        }
+        else
+        {
+            raster.output();
+            auto &pixels = raster.data();
+            result.pixels.assign(pixels.begin(), pixels.end());
+        }
+        return result;
+    });
+    auto future = task->get_future();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        jobs.push([task]()
+                  { (*task)(); });
+    }
+    ready.notify_one();
+    return future;
+}
+
+void render_service::work()
+{
+    for (;;)
+    {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            ready.wait(lock, [this]()
+                       { return stopping || !jobs.empty(); });
+            // drain the queue before stopping
+            if (jobs.empty())
+                return;
+            job = std::move(jobs.front());
+            jobs.pop();
+        }
+        job();
+    }
+}
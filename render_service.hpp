@@ -0,0 +1,58 @@
+#pragma once
+#include <condition_variable>
+#include <functional>
+#include <future>
+#include <mutex>
+#include <queue>
+#include <set>
+#include <string>
+#include <thread>
+#include <vector>
+#include "png.hpp"
+#include "texture_cache.hpp"
+
+struct render_job
+{
+    std::string path;       // scene file
+    std::string output;     // directory to write the PNG to, if any
+    int level = PNG_LEVEL_DEFAULT;
+    int tile_size = 0;      // render in tiles of this size, 0 for off
+    bool pipelined = false; // parse the scene on a thread of its own
+    int replays = 0;        // record a command list and replay it this many
+                            // times, each on a new rasterizer; 0 draws directly
+    std::string update;     // diff applied after a first output, needs tiles
+};
+
+struct render_result
+{
+    std::string filename; // from the scene's "png" command
+    int width, height;
+    size_t draws = 0; // draw calls made, only counted with tiles
+    std::vector<unsigned char> pixels; // RGBA, empty if written to a file
+};
+
+// renders independent scene files on a fixed pool of worker threads, each
+// job with its own rasterizer but all of them sharing one texture cache
+class render_service
+{
+public:
+    explicit render_service(unsigned threads = std::thread::hardware_concurrency(),
+                            texture_cache &textures = texture_cache::shared());
+    ~render_service();
+    // renders job.path; with an output directory the image is written there
+    // under the scene's own file name instead of being returned. That name
+    // is checked before the job is queued: it must be a plain file name,
+    // and no other job of this service may write the same file
+    std::future<render_result> submit(const render_job &job);
+
+private:
+    texture_cache &textures;
+    std::vector<std::thread> workers;
+    std::queue<std::function<void()>> jobs;
+    std::mutex mutex;
+    std::condition_variable ready;
+    bool stopping;
+    std::set<std::string> outputs; // files claimed by submitted jobs
+    void work();
+    std::string claim_output(const render_job &job);
+};
@@ -0,0 +1,451 @@
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <map>
+#include <mutex>
+#include <iostream>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include "scene.hpp"
+#include "threads.hpp"
+
+static const std::map<std::string, scene_op> ops = {
+    {"png", PNG_COMMAND},
+    {"xyzw", XYZW_COMMAND},
+    {"rgb", RGB_COMMAND},
+    {"rgba", RGBA_COMMAND},
+    {"tri", TRI_COMMAND},
+    {"trit", TRIT_COMMAND},
+    {"tris", TRIS_COMMAND},
+    {"tristrip", TRISTRIP_COMMAND},
+    {"trifan", TRIFAN_COMMAND},
+    {"depth", DEPTH_COMMAND},
+    {"sRGB", SRGB_COMMAND},
+    {"hyp", HYP_COMMAND},
+    {"frustum", FRUSTUM_COMMAND},
+    {"fsaa", FSAA_COMMAND},
+    {"cull", CULL_COMMAND},
+    {"texcoord", TEXCOORD_COMMAND},
+    {"texture", TEXTURE_COMMAND},
+    {"point", POINT_COMMAND},
+    {"billboard", BILLBOARD_COMMAND},
+    {"decals", DECALS_COMMAND},
+    {"deferred", DEFERRED_COMMAND},
+    {"clipplane", CLIPPLANE_COMMAND},
+    {"line", LINE_COMMAND},
+    {"wuline", WULINE_COMMAND},
+    {"tiles", TILES_COMMAND},
+    {"loadmatrix", LOADMATRIX_COMMAND},
+    {"multmatrix", MULTMATRIX_COMMAND},
+    {"pushmatrix", PUSHMATRIX_COMMAND},
+    {"popmatrix", POPMATRIX_COMMAND}};
+
+// decodes one line into c, reusing its storage
+static void parse(const std::string &line, scene_command &c, int &scale, const scene_options &options)
+{
+    std::istringstream ss(line);
+    std::string cmd;
+    ss >> cmd;
+
+    if (options.echo && cmd.size())
+        std::cout << line << std::endl;
+
+    auto op = ops.find(cmd);
+    c.op = op == ops.end() ? NOP_COMMAND : op->second;
+    c.arg[0] = c.arg[1] = c.arg[2] = c.arg[3] = 0;
+    c.index[0] = c.index[1] = c.index[2] = 0;
+
+    switch (c.op)
+    {
+    case PNG_COMMAND:
+    {
+        int width = 0, height = 0;
+        ss >> width >> height >> c.name;
+        if (width <= 0 || height <= 0)
+            throw std::invalid_argument("png: width and height must be positive");
+
+        // HACK
+        scale = std::max(1, (options.min_height + height - 1) / height);
+        c.index[0] = width * scale;
+        c.index[1] = height * scale;
+        break;
+    }
+    case XYZW_COMMAND:
+    case CLIPPLANE_COMMAND:
+        ss >> c.arg[0] >> c.arg[1] >> c.arg[2] >> c.arg[3];
+        for (auto &a : c.arg)
+            a *= scale;
+        break;
+    case RGB_COMMAND:
+        ss >> c.arg[0] >> c.arg[1] >> c.arg[2];
+        c.arg[3] = 1.0;
+        break;
+    case RGBA_COMMAND:
+        // TODO: after sRGB
+        ss >> c.arg[0] >> c.arg[1] >> c.arg[2] >> c.arg[3];
+        break;
+    case TRI_COMMAND:
+    case TRIT_COMMAND:
+        ss >> c.index[0] >> c.index[1] >> c.index[2];
+        break;
+    case TRIS_COMMAND:
+    case TRISTRIP_COMMAND:
+    case TRIFAN_COMMAND:
+        c.indices.clear();
+        for (int i; ss >> i;)
+            c.indices.push_back(i);
+        if (!ss.eof())
+            throw std::invalid_argument(cmd + ": indices must be integers");
+        if (c.op == TRIS_COMMAND ? c.indices.empty() || c.indices.size() % 3 : c.indices.size() < 3)
+            throw std::invalid_argument(cmd + (c.op == TRIS_COMMAND ? ": needs indices in threes" : ": needs at least 3 indices"));
+        break;
+    case FSAA_COMMAND:
+    case TILES_COMMAND:
+        ss >> c.index[0];
+        break;
+    case TEXCOORD_COMMAND:
+        ss >> c.arg[0] >> c.arg[1];
+        break;
+    case LOADMATRIX_COMMAND:
+    case MULTMATRIX_COMMAND:
+        // not scaled: scaling x, y, z and w alike already projects the same
+        for (auto &m : c.matrix)
+        {
+            if (!(ss >> m))
+                throw std::invalid_argument(cmd + ": needs 16 numbers");
+        }
+        break;
+    case TEXTURE_COMMAND:
+        ss >> c.name;
+        c.name = options.directory + c.name;
+        break;
+    case POINT_COMMAND:
+    case BILLBOARD_COMMAND:
+        ss >> c.arg[0] >> c.index[0];
+        c.arg[0] *= scale;
+        break;
+    case LINE_COMMAND:
+    case WULINE_COMMAND:
+        ss >> c.index[0] >> c.index[1];
+        break;
+    default:
+        break;
+    }
+}
+
+template <class Target>
+static void execute(Target &raster, scene_command &c, const scene_options &options, std::string &filename)
+{
+    switch (c.op)
+    {
+    case PNG_COMMAND:
+        filename = c.name;
+        if (options.on_resize)
+            options.on_resize(filename, c.index[0], c.index[1]);
+        raster.resize(c.index[0], c.index[1]);
+        break;
+    case XYZW_COMMAND:
+        raster.add_vec(c.arg[0], c.arg[1], c.arg[2], c.arg[3]);
+        break;
+    case RGB_COMMAND:
+    case RGBA_COMMAND:
+        raster.set_color(c.arg[0], c.arg[1], c.arg[2], c.arg[3]);
+        break;
+    case TRI_COMMAND:
+        raster.disable_texture();
+        raster.draw_triangle(c.index[0], c.index[1], c.index[2]);
+        break;
+    case TRIT_COMMAND:
+        raster.enable_texture();
+        raster.draw_triangle(c.index[0], c.index[1], c.index[2]);
+        break;
+    case TRIS_COMMAND:
+        raster.disable_texture();
+        raster.draw_triangles(c.indices);
+        break;
+    case TRISTRIP_COMMAND:
+        raster.disable_texture();
+        raster.draw_triangle_strip(c.indices);
+        break;
+    case TRIFAN_COMMAND:
+        raster.disable_texture();
+        raster.draw_triangle_fan(c.indices);
+        break;
+    case DEPTH_COMMAND:
+        raster.enable_depth();
+        break;
+    case SRGB_COMMAND:
+        raster.enable_srgb();
+        break;
+    case HYP_COMMAND:
+        // TODO: only after sRGB
+        raster.enable_perspective();
+        break;
+    case FRUSTUM_COMMAND:
+        raster.enable_frustum_clipping();
+        break;
+    case FSAA_COMMAND:
+        raster.enable_fsaa(c.index[0]);
+        break;
+    case CULL_COMMAND:
+        raster.cull_face();
+        break;
+    case TEXCOORD_COMMAND:
+        raster.set_texcoord(c.arg[0], c.arg[1]);
+        break;
+    case TEXTURE_COMMAND:
+        raster.load_texture(c.name);
+        break;
+    case POINT_COMMAND:
+        raster.disable_texture();
+        raster.draw_point(c.index[0], c.arg[0]);
+        break;
+    case BILLBOARD_COMMAND:
+        raster.enable_texture();
+        raster.draw_point(c.index[0], c.arg[0]);
+        break;
+    case DECALS_COMMAND:
+        raster.enable_decals();
+        break;
+    case DEFERRED_COMMAND:
+        raster.enable_deferred();
+        break;
+    case CLIPPLANE_COMMAND:
+        raster.clip(c.arg[0], c.arg[1], c.arg[2], c.arg[3]);
+        break;
+    case LINE_COMMAND:
+        raster.draw_line(c.index[0], c.index[1]);
+        break;
+    case WULINE_COMMAND:
+        raster.draw_wuline(c.index[0], c.index[1]);
+        break;
+    case TILES_COMMAND:
+        raster.enable_tiling(c.index[0]);
+        break;
+    case LOADMATRIX_COMMAND:
+        raster.load_matrix(c.matrix);
+        break;
+    case MULTMATRIX_COMMAND:
+        raster.multiply_matrix(c.matrix);
+        break;
+    case PUSHMATRIX_COMMAND:
+        raster.push_matrix();
+        break;
+    case POPMATRIX_COMMAND:
+        raster.pop_matrix();
+        break;
+    default:
+        break;
+    }
+}
+
+// single-producer single-consumer ring of commands; slots are filled and
+// drained in place, so their buffers are reused on every lap. A stalled
+// side spins briefly, then sleeps until the other side moves
+class command_queue
+{
+public:
+    command_queue() : slots(COMMAND_QUEUE_SIZE), head{0}, tail{0}, sleeping{false}, cancelled{false} {}
+
+    // the slot to fill next, or null once the consumer has given up
+    scene_command *reserve()
+    {
+        auto t = tail.load(std::memory_order_relaxed);
+        if (!wait([&]()
+                  { return t - head.load(std::memory_order_acquire) != slots.size(); }))
+            return nullptr;
+        return &slots[t % slots.size()];
+    }
+    void publish()
+    {
+        tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        wake();
+    }
+    scene_command &front()
+    {
+        auto h = head.load(std::memory_order_relaxed);
+        wait([&]()
+             { return tail.load(std::memory_order_acquire) != h; });
+        return slots[h % slots.size()];
+    }
+    void pop()
+    {
+        head.store(head.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+        wake();
+    }
+    void cancel()
+    {
+        cancelled = true;
+        std::lock_guard<std::mutex> lock(mutex);
+        changed.notify_all();
+    }
+
+private:
+    std::vector<scene_command> slots;
+    std::atomic<size_t> head, tail; // next slot to read and to write
+    std::atomic<bool> sleeping; // the other side waits on changed
+    std::atomic<bool> cancelled;
+    std::mutex mutex;
+    std::condition_variable changed;
+
+    // false if the consumer gave up before ready
+    template <class Ready>
+    bool wait(Ready ready)
+    {
+        for (int i = 0; i < COMMAND_QUEUE_SPIN; ++i)
+        {
+            if (ready())
+                return true;
+            if (cancelled.load(std::memory_order_relaxed))
+                return false;
+            std::this_thread::yield();
+        }
+        std::unique_lock<std::mutex> lock(mutex);
+        for (;;)
+        {
+            sleeping = true;
+            // pairs with the fence in wake, so one of us sees the other's write
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+            if (ready() || cancelled.load())
+                break;
+            changed.wait(lock);
+        }
+        sleeping = false;
+        return ready();
+    }
+    // only the first move after the other side fell asleep pays for waking it
+    void wake()
+    {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (sleeping.load(std::memory_order_relaxed) && sleeping.exchange(false))
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            changed.notify_all();
+        }
+    }
+};
+
+template <class Target>
+static std::string run_scene(Target &raster, std::istream &file, const scene_options &options)
+{
+    std::string filename;
+    int scale = 1;
+
+    if (!options.pipelined || !HAVE_THREADS)
+    {
+        scene_command c;
+        for (std::string line; std::getline(file, line);)
+        {
+            parse(line, c, scale, options);
+            execute(raster, c, options, filename);
+        }
+        return filename;
+    }
+
+    command_queue queue;
+    std::exception_ptr error; // from parsing, rethrown once the queue drains
+    std::thread parser([&]()
+                       {
+                           try
+                           {
+                               for (std::string line; std::getline(file, line);)
+                               {
+                                   auto c = queue.reserve();
+                                   if (!c)
+                                       return;
+                                   parse(line, *c, scale, options);
+                                   queue.publish();
+                               }
+                           }
+                           catch (...)
+                           {
+                               error = std::current_exception();
+                           }
+                           auto c = queue.reserve();
+                           if (!c)
+                               return;
+                           c->op = END_COMMAND;
+                           queue.publish(); });
+
+    try
+    {
+        for (;;)
+        {
+            auto &c = queue.front();
+            if (c.op == END_COMMAND)
+                break;
+            execute(raster, c, options, filename);
+            queue.pop();
+        }
+    }
+    catch (...)
+    {
+        queue.cancel();
+        parser.join();
+        throw;
+    }
+    parser.join();
+    if (error)
+        std::rethrow_exception(error);
+    return filename;
+}
+
+std::string render_scene(rasterizer &raster, std::istream &file, const scene_options &options)
+{
+    return run_scene(raster, file, options);
+}
+
+std::string record_scene(command_list &list, std::istream &file, const scene_options &options)
+{
+    return run_scene(list, file, options);
+}
+
+std::string scene_output_name(std::istream &file)
+{
+    std::string name, cmd;
+    for (std::string line; std::getline(file, line);)
+    {
+        std::istringstream ss(line);
+        if (ss >> cmd && cmd == "png")
+        {
+            int width, height;
+            name.clear();
+            ss >> width >> height >> name;
+        }
+    }
+    return name;
+}
+
+primitive_diff read_diff(std::istream &file)
+{
+    primitive_diff diff;
+    for (std::string line; std::getline(file, line);)
+    {
+        std::istringstream ss(line);
+        std::string cmd;
+        if (!(ss >> cmd))
+            continue;
+        if (cmd == "vertex")
+        {
+            int i = 0;
+            vec v(10);
+            ss >> i;
+            for (auto &x : v)
+                ss >> x;
+            if (!ss)
+                throw std::invalid_argument("vertex: needs an index and x y z w r g b a s t");
+            diff.vertices.emplace_back(i, v);
+        }
+        else if (cmd == "remove")
+        {
+            long d = -1;
+            if (!(ss >> d) || d < 0)
+                throw std::invalid_argument("remove: needs a draw number");
+            diff.removed.push_back(d);
+        }
+        else
+            throw std::invalid_argument(cmd + ": not a diff command");
+    }
+    return diff;
+}
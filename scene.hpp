@@ -0,0 +1,88 @@
+#pragma once
+#include <functional>
+#include <istream>
+#include <string>
+#include <vector>
+#include "command_list.hpp"
+#include "rasterize.hpp"
+
+#define COMMAND_QUEUE_SIZE 1024
+// times a stalled side of the queue checks again before it goes to sleep
+#define COMMAND_QUEUE_SPIN 64
+
+struct scene_options
+{
+    // scale small scenes up to at least this many rows, 0 keeps them as is
+    int min_height = 0;
+    // print every command before executing it
+    bool echo = false;
+    // prefix for texture file names, usually the scene's own directory
+    std::string directory;
+    // called on "png" with the output file name and the scaled size
+    std::function<void(const std::string &, int, int)> on_resize;
+    // parse on a second thread while the caller's thread draws
+    bool pipelined = false;
+};
+
+enum scene_op
+{
+    NOP_COMMAND,
+    END_COMMAND,
+    PNG_COMMAND,
+    XYZW_COMMAND,
+    RGB_COMMAND,
+    RGBA_COMMAND,
+    TRI_COMMAND,
+    TRIT_COMMAND,
+    TRIS_COMMAND,
+    TRISTRIP_COMMAND,
+    TRIFAN_COMMAND,
+    DEPTH_COMMAND,
+    SRGB_COMMAND,
+    HYP_COMMAND,
+    FRUSTUM_COMMAND,
+    FSAA_COMMAND,
+    CULL_COMMAND,
+    TEXCOORD_COMMAND,
+    TEXTURE_COMMAND,
+    POINT_COMMAND,
+    BILLBOARD_COMMAND,
+    DECALS_COMMAND,
+    DEFERRED_COMMAND,
+    CLIPPLANE_COMMAND,
+    LINE_COMMAND,
+    WULINE_COMMAND,
+    TILES_COMMAND,
+    LOADMATRIX_COMMAND,
+    MULTMATRIX_COMMAND,
+    PUSHMATRIX_COMMAND,
+    POPMATRIX_COMMAND
+};
+
+// one decoded line of a scene file, with the scale hack already applied
+struct scene_command
+{
+    scene_op op;
+    double arg[4];
+    int index[3];
+    std::vector<int> indices; // tris, tristrip and trifan
+    matrix4 matrix;           // loadmatrix and multmatrix, row by row
+    std::string name;         // png and texture
+};
+
+// executes every command of a scene file against raster and returns the
+// output file name given by the "png" command; the image is left for
+// rasterizer::output() or rasterizer::save() to resolve
+std::string render_scene(rasterizer &raster, std::istream &file, const scene_options &options);
+
+// the same, but records the scene into list for replaying it later
+std::string record_scene(command_list &list, std::istream &file, const scene_options &options);
+
+// the output file name the scene's last "png" command gives, found
+// without executing anything; empty if it has none
+std::string scene_output_name(std::istream &file);
+
+// reads changes for rasterizer::update, one per line:
+//   vertex i x y z w r g b a s t   replaces vertex i, counted as in "tri"
+//   remove d                       takes out draw d, counted from 0
+primitive_diff read_diff(std::istream &file);
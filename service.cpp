@@ -0,0 +1,75 @@
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include "render_service.hpp"
+
+// renders every scene file named on the command line (or one per line on
+// stdin) concurrently and optionally writes the images as PNG files; usage:
+// service [-j threads] [-m cache-bytes] [-o out-dir] [-z level] [-t tile-size] [-p]
+//         [-r replays] [-u diff] [scene...]
+// -r records every scene into a command list once and replays it; -u
+// renders every scene once, then again after the changes in diff
+int main(int argc, char **argv)
+{
+    unsigned threads = std::thread::hardware_concurrency();
+    render_job job;
+    std::vector<std::string> paths;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (!std::strcmp(argv[i], "-j") && i + 1 < argc)
+            threads = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "-m") && i + 1 < argc)
+            texture_cache::shared().set_budget(std::strtoull(argv[++i], nullptr, 10));
+        else if (!std::strcmp(argv[i], "-o") && i + 1 < argc)
+            job.output = argv[++i];
+        else if (!std::strcmp(argv[i], "-z") && i + 1 < argc)
+            job.level = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "-t") && i + 1 < argc)
+            job.tile_size = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "-p"))
+            job.pipelined = true;
+        else if (!std::strcmp(argv[i], "-r") && i + 1 < argc)
+            job.replays = std::atoi(argv[++i]);
+        else if (!std::strcmp(argv[i], "-u") && i + 1 < argc)
+            job.update = argv[++i];
+        else
+            paths.push_back(argv[i]);
+    }
+    if (paths.empty())
+    {
+        for (std::string line; std::getline(std::cin, line);)
+            if (line.size())
+                paths.push_back(line);
+    }
+
+    render_service service(threads);
+    std::vector<std::future<render_result>> results;
+    for (auto &path : paths)
+    {
+        job.path = path;
+        results.push_back(service.submit(job));
+    }
+
+    int status = 0;
+    for (size_t i = 0; i < paths.size(); ++i)
+    {
+        try
+        {
+            auto result = results[i].get();
+            std::cout << paths[i] << ": " << result.filename << ' '
+                      << result.width << 'x' << result.height;
+            // draws are what a diff for -u removes
+            if (result.draws)
+                std::cout << ' ' << result.draws << " draws";
+            std::cout << std::endl;
+        }
+        catch (std::exception &e)
+        {
+            std::cerr << paths[i] << ": " << e.what() << std::endl;
+            status = 1;
+        }
+    }
+    return status;
+}
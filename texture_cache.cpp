@@ -0,0 +1,197 @@
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <sys/stat.h>
+#include "texture_cache.hpp"
+
+texture_cache::texture_cache(size_t budget) : budget{budget}, used{0}, serial{0} {}
+
+texture_cache &texture_cache::shared()
+{
+    static texture_cache cache;
+    return cache;
+}
+
+// FNV-1a
+static uint64_t hash(const std::string &bytes)
+{
+    uint64_t h = 14695981039346656037ull;
+    for (unsigned char c : bytes)
+    {
+        h ^= c;
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static frame_buffer<unsigned char> decode(const std::string &filename, const std::string &bytes)
+{
+    frame_buffer<unsigned char> texture;
+    try
+    {
+        unsigned width, height;
+        auto rgba = read_png(bytes, width, height);
+        texture.resize(width, height);
+        std::copy(rgba.begin(), rgba.end(), texture.data().begin());
+    }
+    catch (std::runtime_error &e)
+    {
+        throw std::runtime_error(filename + ": " + e.what());
+    }
+    return texture;
+}
+
+// stands in for a texture that cannot be read, e.g. one not preloaded on
+// the web: 50 x 50 texels of noise, the same for the same name every time
+static frame_buffer<unsigned char> placeholder(uint64_t seed)
+{
+    frame_buffer<unsigned char> texture(50, 50);
+    // xorshift64, which must not start at 0
+    uint64_t x = seed ? seed : 1;
+    for (auto &c : texture.data())
+    {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        c = x >> 56;
+    }
+    return texture;
+}
+
+bool is_opaque(const frame_buffer<unsigned char> &texture)
+{
+    for (unsigned y = 0; y < texture.height; ++y)
+        for (unsigned x = 0; x < texture.width; ++x)
+            if (texture(x, y, 3) != 255)
+                return false;
+    return true;
+}
+
+bool texture_cache::content_key::operator==(const content_key &other) const
+{
+    return hash == other.hash && size == other.size;
+}
+
+size_t texture_cache::content_hash::operator()(const content_key &key) const
+{
+    return key.hash ^ key.size;
+}
+
+texture_ptr texture_cache::load(const std::string &filename)
+{
+    struct stat info;
+    bool readable = stat(filename.c_str(), &info) == 0;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    // files that have not changed are found without reading them again
+    auto stamp = files.find(filename);
+    if (readable && stamp != files.end() && stamp->second.size == static_cast<size_t>(info.st_size) &&
+        stamp->second.mtime == info.st_mtime)
+    {
+        auto it = entries.find(stamp->second.key);
+        if (it != entries.end())
+        {
+            lru.splice(lru.begin(), lru, it->second.use);
+            auto texture = it->second.texture;
+            lock.unlock();
+            return texture.get();
+        }
+    }
+    lock.unlock();
+
+    // files we cannot read (e.g. not preloaded on the web) are keyed by name
+    std::ifstream file(filename, std::ios::binary);
+    std::string bytes;
+    bool found = static_cast<bool>(file);
+    if (found)
+    {
+        std::ostringstream ss;
+        ss << file.rdbuf();
+        bytes = ss.str();
+    }
+    else
+    {
+        readable = false;
+        bytes = "name:" + filename;
+    }
+    content_key key{hash(bytes), bytes.size()};
+
+    std::promise<texture_ptr> decoded;
+    uint64_t id = 0;
+    lock.lock();
+    auto it = entries.find(key);
+    // a file that changed while being read is not stamped
+    bool stamped = readable && bytes.size() == static_cast<size_t>(info.st_size);
+    if (stamped && (it == entries.end() || it->second.bytes == bytes))
+        files[filename] = {bytes.size(), info.st_mtime, key};
+    if (it != entries.end() && it->second.bytes == bytes)
+    {
+        lru.splice(lru.begin(), lru, it->second.use);
+        auto texture = it->second.texture;
+        lock.unlock();
+        return texture.get();
+    }
+    // a different file with the same hash is decoded but not cached
+    if (it == entries.end())
+    {
+        id = ++serial;
+        lru.push_front(key);
+        entries[key] = {decoded.get_future().share(), bytes, 0, id, lru.begin()};
+    }
+    lock.unlock();
+
+    texture_ptr texture;
+    try
+    {
+        texture = std::make_shared<frame_buffer<unsigned char>>(found ? decode(filename, bytes) : placeholder(key.hash));
+    }
+    catch (...)
+    {
+        decoded.set_exception(std::current_exception());
+        lock.lock();
+        it = entries.find(key);
+        if (id && it != entries.end() && it->second.serial == id)
+        {
+            lru.erase(it->second.use);
+            entries.erase(it);
+        }
+        throw;
+    }
+    decoded.set_value(texture);
+
+    lock.lock();
+    it = entries.find(key);
+    if (id && it != entries.end() && it->second.serial == id)
+    {
+        it->second.size = size_t(texture->width) * texture->height * 4 + bytes.size();
+        used += it->second.size;
+        evict();
+    }
+    return texture;
+}
+
+void texture_cache::set_budget(size_t b)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    budget = b;
+    evict();
+}
+
+size_t texture_cache::size()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return used;
+}
+
+void texture_cache::evict()
+{
+    // never drop the entry that was used last
+    while (used > budget && lru.size() > 1)
+    {
+        auto it = entries.find(lru.back());
+        used -= it->second.size;
+        entries.erase(it);
+        lru.pop_back();
+    }
+}
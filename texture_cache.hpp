@@ -0,0 +1,66 @@
+#pragma once
+#include <cstdint>
+#include <ctime>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include "buffer.hpp"
+
+#define TEXTURE_CACHE_BUDGET (64u << 20)
+
+using texture_ptr = std::shared_ptr<const frame_buffer<unsigned char>>;
+
+// true if no texel is even partly transparent
+bool is_opaque(const frame_buffer<unsigned char> &texture);
+
+// decoded textures keyed by the contents of their files, shared by every
+// rasterizer that loads them; least recently used entries are dropped once
+// the resident size goes over budget (textures still in use stay alive)
+class texture_cache
+{
+public:
+    explicit texture_cache(size_t budget = TEXTURE_CACHE_BUDGET);
+    static texture_cache &shared();
+    // decodes outside the lock, so threads loading different textures do
+    // not wait for each other, and those loading the same one decode once
+    texture_ptr load(const std::string &filename);
+    void set_budget(size_t budget);
+    size_t size();
+
+private:
+    struct content_key
+    {
+        uint64_t hash;
+        size_t size;
+        bool operator==(const content_key &other) const;
+    };
+    struct content_hash
+    {
+        size_t operator()(const content_key &key) const;
+    };
+    struct entry
+    {
+        std::shared_future<texture_ptr> texture;
+        std::string bytes; // to tell files apart whose hashes collide
+        size_t size;       // resident bytes, 0 while decoding
+        uint64_t serial;
+        std::list<content_key>::iterator use;
+    };
+    // what a file looked like when it was last read
+    struct file_stamp
+    {
+        size_t size;
+        time_t mtime;
+        content_key key;
+    };
+    size_t budget, used;
+    uint64_t serial;
+    std::list<content_key> lru; // most recently used first
+    std::unordered_map<content_key, entry, content_hash> entries;
+    std::unordered_map<std::string, file_stamp> files;
+    std::mutex mutex;
+    void evict();
+};
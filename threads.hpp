@@ -0,0 +1,8 @@
+#pragma once
+
+// web builds without pthreads cannot start threads
+#if defined(__EMSCRIPTEN__) && !defined(__EMSCRIPTEN_PTHREADS__)
+#define HAVE_THREADS 0
+#else
+#define HAVE_THREADS 1
+#endif